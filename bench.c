@@ -0,0 +1,419 @@
+/* Copyright 2025 Jack Conger */
+
+/*
+ * This file is part of notcat.
+ *
+ * notcat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notcat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with notcat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks for the formatting hot path: parse_format(), fmt_note(),
+ * print_note() and markup_body(), plus spawning handlers.
+ *
+ * Each case runs in NSAMPLES samples of enough iterations to take at least
+ * SAMPLE_SECS, and reports percentiles of ns/op over the samples, along
+ * with allocations and bytes allocated per op.  Results are also written,
+ * tab-separated with one case per line, to bench_output.txt (or the file
+ * named as the first argument) so they can be compared across changes.
+ *
+ *   ./bench [output file] [case substring]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "notcat.h"
+
+#define NSAMPLES    101
+#define SAMPLE_SECS 200e-6
+
+/*
+ * Allocation counting.  On glibc, defining malloc() here interposes it for
+ * the whole program, libc and GLib included.
+ */
+static size_t alloc_count = 0;
+static size_t alloc_bytes = 0;
+
+#ifdef __GLIBC__
+#define COUNT_ALLOCS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    alloc_count++;
+    alloc_bytes += n * size;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __libc_realloc(p, size);
+}
+#endif
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static FILE *report = NULL;     /* for people */
+static FILE *out = NULL;        /* for tools */
+static const char *only = NULL;
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+typedef void (*bench_fn)(void *arg);
+
+/*
+ * Runs one case.  'bytes' is how much input each op processes, for an
+ * MB/s figure, or 0.
+ */
+static void run_case(const char *name, bench_fn fn, void *arg, size_t bytes) {
+    double samples[NSAMPLES];
+    long per, i;
+    int s;
+
+    if (only && !strstr(name, only))
+        return;
+
+    /* warm up, and find how many iterations make a sample */
+    for (per = 1;; per *= 2) {
+        double start = now();
+        for (i = 0; i < per; i++)
+            fn(arg);
+        if (now() - start >= SAMPLE_SECS)
+            break;
+    }
+
+    size_t count = alloc_count, total = alloc_bytes;
+    for (s = 0; s < NSAMPLES; s++) {
+        double start = now();
+        for (i = 0; i < per; i++)
+            fn(arg);
+        samples[s] = (now() - start) / per * 1e9;
+    }
+    double ops = (double)per * NSAMPLES;
+    double allocs = (alloc_count - count) / ops;
+    double alloc_b = (alloc_bytes - total) / ops;
+
+    qsort(samples, NSAMPLES, sizeof(double), cmp_double);
+    double p50 = samples[NSAMPLES / 2],
+           p90 = samples[NSAMPLES * 90 / 100],
+           p99 = samples[NSAMPLES * 99 / 100];
+    double mbs = (bytes ? bytes / p50 * 1e3 : 0);
+
+    fprintf(report, "%-40s %9.0f %9.0f %9.0f ns/op %6.1f allocs %8.0f B/op",
+            name, p50, p90, p99, allocs, alloc_b);
+    if (bytes)
+        fprintf(report, " %8.1f MB/s", mbs);
+    fprintf(report, "\n");
+    fflush(report);
+
+    fprintf(out, "%s\t%.1f\t%.1f\t%.1f\t%.2f\t%.1f\t%.1f\n",
+            name, p50, p90, p99, allocs, alloc_b, mbs);
+}
+
+/*
+ * The synthetic corpus.
+ */
+
+/* Log-excerpt-like text with a tag every 'tag_every' lines. */
+static char *make_body(size_t len, int tag_every, int malformed) {
+    static const char *line = "2025-01-01 12:00:00 build step finished ok; artifacts uploaded\n";
+    char *b = malloc(len + 128);
+    size_t j = 0;
+    int n = 0;
+    while (j < len) {
+        if (tag_every && ++n % tag_every == 0) {
+            j += sprintf(b + j, "<b>warn</b> &amp; ");
+        }
+        size_t l = strlen(line);
+        memcpy(b + j, line, l);
+        j += l;
+    }
+    if (malformed)
+        j += sprintf(b + j, "<i>");
+    b[j] = '\0';
+    return b;
+}
+
+static struct {
+    const char *name;
+    int tag_every;
+    int malformed;
+} densities[] = {
+    {"plain", 0, 0},
+    {"tags/4", 4, 0},
+    {"tags/1", 1, 0},
+    {"malformed", 0, 1},
+};
+
+static size_t body_sizes[] = {0, 256, 4 * 1024, 64 * 1024};
+
+/* Formats of increasing complexity, to which %(h:) terms are added. */
+static struct {
+    const char *name;
+    size_t len;
+    char *terms[4];
+} formats[] = {
+    {"summary", 1, {"%s"}},
+    {"default", 1, {"%s%(?B: - %B)"}},
+    {"fields", 3, {"%i %a", "[%u] %s", "%(?c:%c )%t"}},
+    {"nested", 2, {"%(?a:%a: %(?s:%s%(?B: - %B)))", "%(?c:<%c>)%n"}},
+};
+
+/*
+ * notlib gives no way to attach hints to a note from here, so these
+ * measure looking up (missing) hints, not stringifying them.
+ */
+static size_t hint_counts[] = {0, 4, 16};
+
+typedef struct {
+    format f;
+    char **strs;
+    size_t len;
+    NLNote note;
+} corpus;
+
+static void make_format(corpus *c, size_t fi, size_t hints) {
+    size_t i;
+    c->len = formats[fi].len + hints;
+    c->strs = malloc(sizeof(char *) * c->len);
+    for (i = 0; i < formats[fi].len; i++)
+        c->strs[i] = strdup(formats[fi].terms[i]);
+    for (i = 0; i < hints; i++) {
+        char term[48];
+        snprintf(term, sizeof(term), "%%(h:x-hint-%zu)", i);
+        c->strs[formats[fi].len + i] = strdup(term);
+    }
+    c->f = parse_format(c->len, c->strs);
+}
+
+static void free_strs(corpus *c) {
+    size_t i;
+    for (i = 0; i < c->len; i++)
+        free(c->strs[i]);
+    free(c->strs);
+    free_format(&c->f);
+}
+
+static void make_note(NLNote *n, char *body) {
+    memset(n, 0, sizeof(*n));
+    n->id = 1234;
+    n->appname = "bench";
+    n->summary = "Build finished";
+    n->body = body;
+    n->timeout = 5000;
+    n->urgency = URG_NORM;
+}
+
+/*
+ * The cases.
+ */
+
+static void do_parse(void *arg) {
+    corpus *c = arg;
+    format f = parse_format(c->len, c->strs);
+    free_format(&f);
+}
+
+static void do_fmt_note(void *arg) {
+    corpus *c = arg;
+    size_t i;
+    fmt_ctx ctx;
+    fmt_ctx_init(&ctx, &c->f, &c->note);
+    for (i = 0; i < c->f.len; i++)
+        free(fmt_note(&c->f.terms[i], &ctx));
+    fmt_ctx_free(&ctx);
+}
+
+static void do_print_note(void *arg) {
+    corpus *c = arg;
+    fmt_ctx ctx;
+    fmt_ctx_init(&ctx, &c->f, &c->note);
+    ctx.event = "notify";
+    print_note(&ctx);
+    fmt_ctx_free(&ctx);
+}
+
+typedef struct {
+    const char *in;
+    char *out;
+} markup_arg;
+
+static void do_markup(void *arg) {
+    markup_arg *m = arg;
+    markup_body(m->in, m->out);
+}
+
+static void bench_parse(void) {
+    char name[96];
+    size_t fi, hi;
+    for (fi = 0; fi < sizeof(formats) / sizeof(formats[0]); fi++) {
+        for (hi = 0; hi < sizeof(hint_counts) / sizeof(hint_counts[0]); hi++) {
+            corpus c;
+            make_format(&c, fi, hint_counts[hi]);
+            snprintf(name, sizeof(name), "parse/%s/hints=%zu",
+                     formats[fi].name, hint_counts[hi]);
+            run_case(name, do_parse, &c, 0);
+            free_strs(&c);
+        }
+    }
+}
+
+static void bench_fmt(void) {
+    char name[96];
+    size_t fi, hi, si;
+    for (si = 0; si < sizeof(body_sizes) / sizeof(body_sizes[0]); si++) {
+        char *body = make_body(body_sizes[si], 4, 0);
+        for (fi = 0; fi < sizeof(formats) / sizeof(formats[0]); fi++) {
+            for (hi = 0; hi < sizeof(hint_counts) / sizeof(hint_counts[0]); hi++) {
+                corpus c;
+                make_format(&c, fi, hint_counts[hi]);
+                make_note(&c.note, body);
+
+                snprintf(name, sizeof(name), "fmt_note/%s/hints=%zu/body=%zu",
+                         formats[fi].name, hint_counts[hi], body_sizes[si]);
+                run_case(name, do_fmt_note, &c, 0);
+
+                snprintf(name, sizeof(name), "print_note/%s/hints=%zu/body=%zu",
+                         formats[fi].name, hint_counts[hi], body_sizes[si]);
+                run_case(name, do_print_note, &c, 0);
+                free_strs(&c);
+            }
+        }
+        free(body);
+    }
+}
+
+static void bench_markup(void) {
+    const char *impls[] = {"scalar", "sse2", "avx2"};
+    const char *best = scan_name();
+    char name[96];
+    size_t di, si, ii;
+    for (di = 0; di < sizeof(densities) / sizeof(densities[0]); di++) {
+        for (si = 1; si < sizeof(body_sizes) / sizeof(body_sizes[0]); si++) {
+            markup_arg m;
+            char *body = make_body(body_sizes[si], densities[di].tag_every,
+                                   densities[di].malformed);
+            size_t len = strlen(body);
+            m.in = body;
+            m.out = malloc(len + 1);
+
+            for (ii = 0; ii < sizeof(impls) / sizeof(impls[0]); ii++) {
+                if (!scan_select(impls[ii]))
+                    continue;
+                snprintf(name, sizeof(name), "markup/%s/body=%zu/%s",
+                         densities[di].name, body_sizes[si], impls[ii]);
+                run_case(name, do_markup, &m, len);
+            }
+            free(m.out);
+            free(body);
+        }
+    }
+    scan_select(best);
+}
+
+/*
+ * Spawning a trivial handler: the way run_cmd() used to do it, and
+ * run_cmd() itself.  'ballast' bytes of touched memory stand in for a
+ * process with a large heap, where copying page tables makes fork costly.
+ */
+static void do_spawnp(void *arg) {
+    extern char **environ;
+    char *argv[] = {"true", NULL};
+    pid_t pid;
+    if (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) == 0)
+        waitpid(pid, NULL, 0);
+}
+
+static void do_run_cmd(void *arg) {
+    static format empty;
+    fmt_ctx ctx;
+    fmt_ctx_init(&ctx, &empty, arg);
+    ctx.event = "notify";
+    run_cmd("true", &ctx);
+    fmt_ctx_free(&ctx);
+}
+
+static void bench_spawn(size_t ballast) {
+    NLNote note;
+    char name[96];
+    make_note(&note, "");
+
+    char *mem = malloc(ballast + 1);
+    memset(mem, 1, ballast + 1);
+
+    snprintf(name, sizeof(name), "spawn/posix_spawnp/heap=%zuM", ballast >> 20);
+    run_case(name, do_spawnp, NULL, 0);
+    snprintf(name, sizeof(name), "spawn/run_cmd/heap=%zuM", ballast >> 20);
+    run_case(name, do_run_cmd, &note, 0);
+
+    free(mem);
+}
+
+int main(int argc, char **argv) {
+    const char *path = (argc > 1 ? argv[1] : "bench_output.txt");
+    if (argc > 2)
+        only = argv[2];
+
+    if (!(out = fopen(path, "w"))) {
+        perror(path);
+        return 1;
+    }
+    fprintf(out, "# case\tp50_ns\tp90_ns\tp99_ns\tallocs_per_op\tbytes_per_op\tmb_per_s\n");
+#ifndef COUNT_ALLOCS
+    fprintf(stderr, "bench: allocations are not counted on this platform\n");
+#endif
+
+    /* print_note() writes to standard output; send that nowhere */
+    fflush(stdout);
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    fprintf(report, "%-40s %9s %9s %9s\n", "case", "p50", "p90", "p99");
+    bench_parse();
+    bench_fmt();
+    bench_markup();
+    bench_spawn(0);
+    bench_spawn(512 << 20);
+
+    fclose(out);
+    return 0;
+}
+
+/* vim: set ft=c tabstop=4 softtabstop=4 shiftwidth=4 expandtab textwidth=0: */
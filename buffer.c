@@ -19,9 +19,16 @@
 
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 
-#include "notcat.h"
+#include "libnotcat.h"
+
+/*
+ * Buffers are growable byte strings meant to be reused: reset_buffer()
+ * empties one without releasing its memory, and buffer_view() returns the
+ * contents in place.  There is always room for a trailing NUL.
+ */
 
 struct _buffer {
     size_t len;
@@ -30,10 +37,10 @@ struct _buffer {
 };
 
 static void check_buffer_size(buffer *buf, size_t cn) {
-    ptrdiff_t csz = buf->curr - buf->start;
-    if (csz + cn > buf->len) {
-        ptrdiff_t nsz = (csz == 0 ? 1 : csz * 2);
-        while (nsz < (csz + cn)) {
+    size_t csz = buf->curr - buf->start;
+    if (csz + cn + 1 > buf->len) {
+        size_t nsz = (buf->len == 0 ? 1 : buf->len * 2);
+        while (nsz < csz + cn + 1) {
             nsz = nsz * 2;
         }
         buf->len = nsz;
@@ -44,12 +51,8 @@ static void check_buffer_size(buffer *buf, size_t cn) {
 
 extern void put_strn(buffer *buf, size_t cn, const char *c) {
     check_buffer_size(buf, cn);
-
-    size_t i;
-    for (i = 0; i < cn; i++) {
-        *(buf->curr) = c[i];
-        buf->curr++;
-    }
+    memcpy(buf->curr, c, cn);
+    buf->curr += cn;
 }
 
 extern void put_str(buffer *buf, const char *c) {
@@ -62,16 +65,86 @@ extern void put_char(buffer *buf, char c) {
     buf->curr++;
 }
 
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+/* Formats u two digits at a time, right to left, into the end of tmp. */
+extern size_t fmt_uint(char tmp[10], uint32_t u) {
+    char *p = tmp + 10;
+    while (u >= 100) {
+        uint32_t r = u % 100;
+        u /= 100;
+        p -= 2;
+        memcpy(p, digit_pairs + 2 * r, 2);
+    }
+    if (u >= 10) {
+        p -= 2;
+        memcpy(p, digit_pairs + 2 * u, 2);
+    } else {
+        *--p = '0' + u;
+    }
+    return tmp + 10 - p;
+}
+
+extern void put_uint(buffer *buf, uint32_t u) {
+    char tmp[10];
+    size_t n = fmt_uint(tmp, u);
+    put_strn(buf, n, tmp + 10 - n);
+}
+
+extern void put_int(buffer *buf, int32_t i) {
+    if (i < 0) {
+        put_char(buf, '-');
+        put_uint(buf, UINT32_MAX - (uint32_t) i + 1);
+    } else {
+        put_uint(buf, i);
+    }
+}
+
+extern char *buffer_reserve(buffer *buf, size_t cn) {
+    check_buffer_size(buf, cn);
+    return buf->curr;
+}
+
 extern buffer *new_buffer(size_t initial) {
     buffer *b = malloc(sizeof(buffer));
 
-    b->len = initial;
-    b->start = malloc(sizeof(char *) * initial);
+    b->len = (initial > 0 ? initial : 1);
+    b->start = malloc(b->len);
     b->curr = b->start;
 
     return b;
 }
 
+extern void reset_buffer(buffer *buf) {
+    buf->curr = buf->start;
+}
+
+extern size_t buffer_len(buffer *buf) {
+    return buf->curr - buf->start;
+}
+
+extern const char *buffer_view(buffer *buf, size_t *len) {
+    *(buf->curr) = '\0';
+    if (len != NULL)
+        *len = buf->curr - buf->start;
+    return buf->start;
+}
+
+extern void free_buffer(buffer *buf) {
+    free(buf->start);
+    free(buf);
+}
+
 extern char *dump_buffer(buffer *buf) {
     char *r = buf->start;
     *(buf->curr) = '\0';
@@ -72,13 +72,11 @@ extern void add_capability(char *cap) {
 static bool body_term(fmt_term t) {
     size_t i;
     for (i = 0; i < t.len; i++) {
-        switch (t.items[i].type) {
+        switch (t.ops[i].type) {
         case 'b': case 'B':
             return true;
-        case ITEM_TYPE_CONDITIONAL:
-            if (t.items[i].chr == 'b' || t.items[i].chr == 'B')
-                return true;
-            if (body_term(t.items[i].subterm))
+        case OP_COND:
+            if (t.ops[i].chr == 'b' || t.ops[i].chr == 'B')
                 return true;
         }
     }
@@ -88,28 +86,26 @@ static bool body_term(fmt_term t) {
 static bool body_fmt_term(fmt_term t) {
     size_t i;
     for (i = 0; i < t.len; i++) {
-        switch (t.items[i].type) {
+        switch (t.ops[i].type) {
         case 'B':
             return true;
-        case ITEM_TYPE_CONDITIONAL:
-            if (t.items[i].chr == 'B')
-                return true;
-            if (body_fmt_term(t.items[i].subterm))
+        case OP_COND:
+            if (t.ops[i].chr == 'B')
                 return true;
         }
     }
     return false;
 }
 
-extern void fmt_capabilities(void) {
+extern void fmt_capabilities(const format *fmt) {
     size_t i;
     bool body = false;
     bool markup = false;
-    for (i = 0; i < fmt.len; i++) {
-        if (body_fmt_term(fmt.terms[i])) {
+    for (i = 0; i < fmt->len; i++) {
+        if (body_fmt_term(fmt->terms[i])) {
             body = true;
             markup = true;
-        } else if (body_term(fmt.terms[i])) {
+        } else if (body_term(fmt->terms[i])) {
             body = true;
         }
         if (body && markup)
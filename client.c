@@ -17,12 +17,17 @@
  * along with notcat.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <gio/gio.h>
 
 #include "notcat.h"
 
+#define BATCH_WINDOW 64
+
 static GDBusConnection *connect(void) {
     GDBusConnection *conn;
     GError *error = NULL;
@@ -44,8 +49,11 @@ static GDBusProxy *make_proxy(GDBusConnection *conn) {
     if (conn == NULL)
         return NULL;
 
+    /* The interface has no properties, and we subscribe to signals
+     * ourselves, so skip the round trips to set those up. */
     proxy = g_dbus_proxy_new_sync(conn,
-                                  G_DBUS_PROXY_FLAGS_NONE,
+                                  G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES
+                                  | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
                                   NULL,
                                   "org.freedesktop.Notifications",
                                   "/org/freedesktop/Notifications",
@@ -61,14 +69,33 @@ static GDBusProxy *make_proxy(GDBusConnection *conn) {
     return proxy;
 }
 
-static GVariant *call(GDBusProxy *proxy, char *name, GVariant *args) {
+/*
+ * One-shot calls go over a raw connection (see wire.c) when one can be
+ * made, and through a GIO proxy otherwise.  Anything which needs signals
+ * or asynchronous calls uses GIO directly.
+ */
+typedef struct {
+    wire *w;
+    GDBusProxy *proxy;
+} bus;
+
+static bus open_bus(void) {
+    bus b = { wire_open(), NULL };
+    if (b.w == NULL)
+        b.proxy = make_proxy(connect());
+    return b;
+}
+
+static GVariant *call(bus *b, char *name, GVariant *args) {
     GVariant *result;
     GError *error = NULL;
 
-    if (proxy == NULL)
+    if (b->w != NULL)
+        return wire_call(b->w, name, args);
+    if (b->proxy == NULL)
         return NULL;
 
-    result = g_dbus_proxy_call_sync(proxy,
+    result = g_dbus_proxy_call_sync(b->proxy,
             name,
             args,
             G_DBUS_CALL_FLAGS_NONE,
@@ -108,7 +135,8 @@ static void signal_callback(GDBusConnection *conn,
     }
 }
 
-static int listen(GDBusConnection *conn, signal_callback_type cb, void *data) {
+static int listen(GDBusConnection *conn, const char *member,
+                  signal_callback_type cb, void *data) {
     GMainLoop *loop;
 
     if (conn == NULL)
@@ -120,10 +148,12 @@ static int listen(GDBusConnection *conn, signal_callback_type cb, void *data) {
     ud.callback = cb;
     ud.loop = loop;
     ud.data = data;
+    // Only the server's own signals.  The bus can match string arguments
+    // but not the uint32 ids, so those are filtered in the callback.
     ud.sub_id = g_dbus_connection_signal_subscribe(conn,
-                        NULL,
                         "org.freedesktop.Notifications",
-                        NULL,
+                        "org.freedesktop.Notifications",
+                        member,
                         "/org/freedesktop/Notifications",
                         NULL,
                         G_DBUS_SIGNAL_FLAGS_NONE,
@@ -140,39 +170,98 @@ static int get_int(char *str, long *out) {
     return (str != NULL && *str != '\0' && *end == '\0');
 }
 
-static int sync_send_callback(const gchar *signal_name,
-                              GVariant *parameters, void *data) {
-    guint32 id = *(guint32 *)data;
+/* The notifications still open, sorted, for 'send --sync' and 'wait'. */
+typedef struct {
+    uint32_t *ids;
+    size_t len;
+    char print_id;  /* prefix invoked actions with the id */
+} wait_set;
+
+static int cmp_id(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Sorts ids and drops duplicates, returning the new length. */
+static size_t sort_ids(uint32_t *ids, size_t len) {
+    size_t i, n = 0;
+    if (len == 0)
+        return 0;
+    qsort(ids, len, sizeof(uint32_t), cmp_id);
+    for (i = 0; i < len; i++)
+        if (n == 0 || ids[n - 1] != ids[i])
+            ids[n++] = ids[i];
+    return n;
+}
+
+static int wait_callback(const gchar *signal_name,
+                         GVariant *parameters, void *data) {
+    wait_set *w = data;
+    if (g_variant_n_children(parameters) == 0)
+        return 0;
     GVariant *iv = g_variant_get_child_value(parameters, 0);
-    if (id != g_variant_get_uint32(iv)) {
+    if (!g_variant_is_of_type(iv, G_VARIANT_TYPE_UINT32)) {
         g_variant_unref(iv);
         return 0;
     }
+    uint32_t id = g_variant_get_uint32(iv);
     g_variant_unref(iv);
 
-    if (!strcmp(signal_name, "NotificationClosed"))
-        return 1;
+    uint32_t *p = bsearch(&id, w->ids, w->len, sizeof(uint32_t), cmp_id);
+    if (p == NULL)
+        return 0;
+
+    if (!strcmp(signal_name, "NotificationClosed")) {
+        memmove(p, p + 1, (w->ids + --w->len - p) * sizeof(uint32_t));
+        return (w->len == 0);
+    }
 
     if (!strcmp(signal_name, "ActionInvoked")) {
         GVariant *av = g_variant_get_child_value(parameters, 1);
+        if (w->print_id)
+            printf("%u ", id);
         printf("%s\n", g_variant_get_string(av, NULL));
+        fflush(stdout);
         g_variant_unref(av);
     }
     return 0;
 }
 
-extern int send_note(int argc, char **argv) {
-    char *app_name = "notcat";
-    char *app_icon = "";
-    char *summary = NULL;
-    char *body = NULL;
-    long id = 0;
-    long timeout = -1;
-    GVariantBuilder *actions = g_variant_builder_new(G_VARIANT_TYPE("as"));
-    GVariantBuilder *hints = g_variant_builder_new(G_VARIANT_TYPE("a{sv}"));
-
-    char print_id = 0;
-    char sync = 0;
+/* The arguments to 'send', parsed. */
+typedef struct {
+    char *app_name;
+    char *app_icon;
+    char *summary;
+    char *body;
+    long id;
+    long timeout;
+    GVariantBuilder *actions;
+    GVariantBuilder *hints;
+
+    char print_id;
+    char sync;
+    long batch;     /* in-flight window for --batch, or 0 */
+} send_args;
+
+static void free_send_args(send_args *a) {
+    g_variant_builder_unref(a->actions);
+    g_variant_builder_unref(a->hints);
+}
+
+/* Returns 0, or the exit status for bad arguments. */
+static int parse_send_args(int argc, char **argv, send_args *a) {
+    a->app_name = "notcat";
+    a->app_icon = "";
+    a->summary = NULL;
+    a->body = NULL;
+    a->id = 0;
+    a->timeout = -1;
+    a->actions = g_variant_builder_new(G_VARIANT_TYPE("as"));
+    a->hints = g_variant_builder_new(G_VARIANT_TYPE("a{sv}"));
+
+    a->print_id = 0;
+    a->sync = 0;
+    a->batch = 0;
 
     char mode = '\0';
     int skip = 0;
@@ -184,22 +273,22 @@ extern int send_note(int argc, char **argv) {
         // Use the current argument to get the value for that field.
         case 'a':
 get_appname:
-            app_name = arg;
+            a->app_name = arg;
             break;
         case 'i':
 get_id:
-            if (!get_int(argv[i], &id) || id < 0 || id > 0xFFFFFFFF) {
+            if (!get_int(argv[i], &a->id) || a->id < 0 || a->id > 0xFFFFFFFF) {
                 fprintf(stderr, "ID must be a valid value of uint32\n");
                 return 2;
             }
             break;
         case 'I':
 get_icon:
-            app_icon = arg;
+            a->app_icon = arg;
             break;
         case 't':
 get_timeout:
-            if (!get_int(argv[i], &timeout) || timeout < -1 || timeout > 0x7FFFFFFF) {
+            if (!get_int(argv[i], &a->timeout) || a->timeout < -1 || a->timeout > 0x7FFFFFFF) {
                 fprintf(stderr, "Timeout must be a valid int32 not less "
                         "than -1\n");
                 return 2;
@@ -207,7 +296,7 @@ get_timeout:
             break;
         case 'c':
 get_category:
-            g_variant_builder_add(hints, "{sv}", "category",
+            g_variant_builder_add(a->hints, "{sv}", "category",
                     g_variant_new_string(arg));
             break;
         case 'A':
@@ -226,14 +315,14 @@ get_actions: {
                     if (*c2 != ':')
                         continue;
                     *c2 = '\0';
-                    g_variant_builder_add(actions, "s", arg);
-                    g_variant_builder_add(actions, "s", c2 + 1);
+                    g_variant_builder_add(a->actions, "s", arg);
+                    g_variant_builder_add(a->actions, "s", c2 + 1);
                     *c2 = ':';
                     break;
                 }
                 if (!*c2) {
-                    g_variant_builder_add(actions, "s", arg);
-                    g_variant_builder_add(actions, "s", arg);
+                    g_variant_builder_add(a->actions, "s", arg);
+                    g_variant_builder_add(a->actions, "s", arg);
                 }
 
                 arg = c + reset;
@@ -290,19 +379,19 @@ get_hint: {
                         value, fs, e->message);
                 return 2;
             }
-            g_variant_builder_add(hints, "{sv}", name, gv);
+            g_variant_builder_add(a->hints, "{sv}", name, gv);
             break;
         }
         case 'u':
 get_urgency:
             if (!strcmp(arg, "low") || !strcmp(arg, "LOW")) {
-                g_variant_builder_add(hints, "{sv}", "urgency",
+                g_variant_builder_add(a->hints, "{sv}", "urgency",
                         g_variant_new_byte(0));
             } else if (!strcmp(arg, "normal") || !strcmp(arg, "NORMAL")) {
-                g_variant_builder_add(hints, "{sv}", "urgency",
+                g_variant_builder_add(a->hints, "{sv}", "urgency",
                         g_variant_new_byte(1));
             } else if (!strcmp(arg, "critical") || !strcmp(arg, "CRITICAL")) {
-                g_variant_builder_add(hints, "{sv}", "urgency",
+                g_variant_builder_add(a->hints, "{sv}", "urgency",
                         g_variant_new_byte(2));
             } else {
                 fprintf(stderr, "Urgency must be one of 'low', 'normal', or 'critical'\n");
@@ -323,7 +412,7 @@ get_urgency:
                         continue;
                     case 'p':
                         // Print ID notification receives
-                        print_id = 1;
+                        a->print_id = 1;
                         continue;
                     case 't': case 'i': case 'a': case 'A': case 'h':
                     case 'u': case 'c': case 'I':
@@ -366,10 +455,19 @@ get_urgency:
                     arg += 7;
                     goto get_icon;
                 } else if (!strcmp(arg, "--print-id")) {
-                    print_id = 1;
+                    a->print_id = 1;
                     break;
                 } else if (!strcmp(arg, "--sync")) {
-                    sync = 1;
+                    a->sync = 1;
+                    break;
+                } else if (!strcmp(arg, "--batch")) {
+                    a->batch = BATCH_WINDOW;
+                    break;
+                } else if (!strncmp(arg, "--batch=", 8)) {
+                    if (!get_int(arg + 8, &a->batch) || a->batch < 1) {
+                        fprintf(stderr, "Batch window must be a positive integer\n");
+                        return 2;
+                    }
                     break;
                 }
 
@@ -378,10 +476,10 @@ get_urgency:
 
             // If it's not an option, then it's the summary, the body, or
             // an error.  Do the right thing in those cases.
-            if (summary == NULL) {
-                summary = arg;
-            } else if (body == NULL) {
-                body = arg;
+            if (a->summary == NULL) {
+                a->summary = arg;
+            } else if (a->body == NULL) {
+                a->body = arg;
             } else {
                 fprintf(stderr, "Exactly one summary and one body argument expected\n");
                 return 2;
@@ -395,39 +493,246 @@ get_urgency:
         return 2;
     }
 
-    if (summary == NULL)
-        summary = "";
+    if (a->summary == NULL)
+        a->summary = "";
 
-    if (body == NULL)
-        body = "";
+    if (a->body == NULL)
+        a->body = "";
 
-    GDBusConnection *conn = connect();
-    GDBusProxy *proxy = make_proxy(conn);
-    if (proxy == NULL)
-        return 1;
-    GVariant *result = call(proxy, "Notify",
-            g_variant_new("(susssasa{sv}i)",
-                app_name,
-                (u_int32_t) id,
-                app_icon,
-                summary,
-                body,
-                actions,
-                hints,
-                (int32_t) timeout));
+    return 0;
+}
+
+static GVariant *notify_args(send_args *a) {
+    return g_variant_new("(susssasa{sv}i)",
+            a->app_name,
+            (uint32_t) a->id,
+            a->app_icon,
+            a->summary,
+            a->body,
+            a->actions,
+            a->hints,
+            (int32_t) a->timeout);
+}
+
+/* Sends the notification, returning 0 and its ID or an exit status. */
+static int notify_call(bus *b, send_args *a, uint32_t *id) {
+    GVariant *result = call(b, "Notify", notify_args(a));
 
     if (result == NULL)
         return 1;
 
-    id = g_variant_get_uint32(g_variant_get_child_value(result, 0));
+    GVariant *iv = g_variant_get_child_value(result, 0);
+    *id = g_variant_get_uint32(iv);
+    g_variant_unref(iv);
+    g_variant_unref(result);
+    return 0;
+}
+
+/*
+ * send --batch: each line of standard input holds the arguments for one
+ * notification, separated by tabs, which follow any arguments given on the
+ * command line.  Up to 'window' Notify calls are in flight at once, and the
+ * IDs are printed in input order, with an empty line for any notification
+ * which could not be sent.
+ */
+typedef struct {
+    char done;
+    char failed;
+    uint32_t id;
+} batch_slot;
+
+static struct {
+    batch_slot *slots;  /* indexed by line number, modulo the window */
+    size_t window;
+    size_t sent, replied, printed;
+    int status;
+} batch;
+
+static void batch_reply(GObject *src, GAsyncResult *res, gpointer data) {
+    batch_slot *s = data;
+    GError *error = NULL;
+    GVariant *result = g_dbus_proxy_call_finish(G_DBUS_PROXY(src), res, &error);
+
+    if (error != NULL) {
+        fprintf(stderr, "DBus call error (Notify): %s\n", error->message);
+        g_error_free(error);
+        s->failed = 1;
+    } else {
+        GVariant *iv = g_variant_get_child_value(result, 0);
+        s->id = g_variant_get_uint32(iv);
+        g_variant_unref(iv);
+        g_variant_unref(result);
+    }
+    s->done = 1;
+    batch.replied++;
+}
+
+static void batch_print(void) {
+    for (; batch.printed < batch.sent; batch.printed++) {
+        batch_slot *s = &batch.slots[batch.printed % batch.window];
+        if (!s->done)
+            return;
+        if (s->failed) {
+            batch.status = 1;
+            putchar('\n');
+        } else {
+            printf("%u\n", s->id);
+        }
+    }
+}
 
-    if (print_id)
-        printf("%ld\n", id);
+/* Splits line into fields at tabs, undoing \\, \t and \n escapes in place. */
+static size_t split_fields(char *line, char ***fields, size_t *cap, size_t n) {
+    char *r = line, *w = line;
+
+    for (;;) {
+        if (n == *cap) {
+            *cap = (*cap ? *cap * 2 : 16);
+            *fields = realloc(*fields, sizeof(char *) * *cap);
+        }
+        (*fields)[n++] = w;
+
+        for (; *r && *r != '\t' && *r != '\n'; r++) {
+            if (*r == '\\' && r[1] != '\0') {
+                r++;
+                *w++ = (*r == 't' ? '\t' : *r == 'n' ? '\n' : *r);
+            } else {
+                *w++ = *r;
+            }
+        }
+        if (*r != '\t') {
+            *w = '\0';
+            return n;
+        }
+        r++;
+        *w++ = '\0';
+    }
+}
+
+static int send_batch(GDBusProxy *proxy, int argc, char **argv, long window) {
+    char *line = NULL;
+    size_t line_cap = 0;
+    char **fields = NULL;
+    size_t fields_cap = 0;
+    int eof = 0;
+    int i;
+
+    if (proxy == NULL)
+        return 1;
+
+    batch.window = window;
+    batch.slots = calloc(window, sizeof(batch_slot));
+
+    while (!eof || batch.replied < batch.sent) {
+        while (!eof && batch.sent - batch.printed < batch.window) {
+            if (getline(&line, &line_cap, stdin) == -1) {
+                eof = 1;
+                break;
+            }
+
+            // parse_send_args modifies its arguments, so the ones from the
+            // command line are copied for each line.
+            for (i = 0; i < argc; i++) {
+                if (i == fields_cap) {
+                    fields_cap = (fields_cap ? fields_cap * 2 : 16);
+                    fields = realloc(fields, sizeof(char *) * fields_cap);
+                }
+                fields[i] = strdup(argv[i]);
+            }
+            size_t n = split_fields(line, &fields, &fields_cap, argc);
 
-    if (!sync)
+            batch_slot *s = &batch.slots[batch.sent++ % batch.window];
+            memset(s, 0, sizeof(*s));
+
+            send_args a;
+            if (parse_send_args(n, fields, &a)) {
+                s->failed = s->done = 1;
+                batch.replied++;
+            } else {
+                g_dbus_proxy_call(proxy, "Notify", notify_args(&a),
+                        G_DBUS_CALL_FLAGS_NONE, -1, NULL, batch_reply, s);
+            }
+            free_send_args(&a);
+            for (i = 0; i < argc; i++)
+                free(fields[i]);
+        }
+
+        batch_print();
+        if (batch.replied < batch.sent)
+            g_main_context_iteration(NULL, TRUE);
+    }
+    batch_print();
+
+    free(fields);
+    free(line);
+    free(batch.slots);
+    return batch.status;
+}
+
+extern int send_note(int argc, char **argv) {
+    send_args a;
+    uint32_t id;
+    int status;
+
+    if ((status = parse_send_args(argc, argv, &a)))
+        return status;
+
+    if (a.batch) {
+        free_send_args(&a);
+        if (a.sync) {
+            fprintf(stderr, "--sync cannot be used with --batch\n");
+            return 2;
+        }
+        return send_batch(make_proxy(connect()), argc, argv, a.batch);
+    }
+
+    // --sync needs signals, so it goes through GIO from the start.
+    GDBusConnection *conn = NULL;
+    bus b;
+    if (a.sync) {
+        conn = connect();
+        b.w = NULL;
+        b.proxy = make_proxy(conn);
+    } else {
+        b = open_bus();
+    }
+
+    status = notify_call(&b, &a, &id);
+    free_send_args(&a);
+    wire_close(b.w);
+    if (status)
+        return status;
+
+    if (a.print_id)
+        printf("%u\n", id);
+
+    if (!a.sync)
         return 0;
 
-    return listen(conn, sync_send_callback, &id);
+    wait_set w = { &id, 1, 0 };
+    return listen(conn, NULL, wait_callback, &w);
+}
+
+/*
+ * Like 'send', but over one connection kept for the life of the process,
+ * and without printing anything.  This is what notcat-bench uses.
+ */
+extern int send_note_args(int argc, char **argv, uint32_t *id) {
+    static bus b;
+    static int opened = 0;
+    send_args a;
+    int status;
+
+    if ((status = parse_send_args(argc, argv, &a)))
+        return status;
+    if (!opened) {
+        b = open_bus();
+        opened = 1;
+    }
+
+    status = notify_call(&b, &a, id);
+    free_send_args(&a);
+    return status;
 }
 
 extern int close_note(char *arg) {
@@ -438,16 +743,18 @@ extern int close_note(char *arg) {
     if (id < 0 || id > 65536)
         return 11;
 
-    GDBusProxy *proxy = make_proxy(connect());
-    GVariant *result = call(proxy, "CloseNotification",
+    bus b = open_bus();
+    GVariant *result = call(&b, "CloseNotification",
                             g_variant_new("(u)", id));
+    wire_close(b.w);
 
     return (result == NULL);
 }
 
 extern int get_capabilities(void) {
-    GDBusProxy *proxy = make_proxy(connect());
-    GVariant *result = call(proxy, "GetCapabilities", NULL);
+    bus b = open_bus();
+    GVariant *result = call(&b, "GetCapabilities", NULL);
+    wire_close(b.w);
 
     if (result == NULL)
         return 1;
@@ -463,8 +770,9 @@ extern int get_capabilities(void) {
 }
 
 extern int get_server_information(void) {
-    GDBusProxy *proxy = make_proxy(connect());
-    GVariant *result = call(proxy, "GetServerInformation", NULL);
+    bus b = open_bus();
+    GVariant *result = call(&b, "GetServerInformation", NULL);
+    wire_close(b.w);
 
     if (result == NULL)
         return 1;
@@ -481,36 +789,206 @@ extern int get_server_information(void) {
     return 0;
 }
 
+/*
+ * listen: each signal is written through the format engine, like a note
+ * in the server, or as a line of JSON.
+ */
+typedef struct {
+    format fmt;
+    char json;
+    char default_fmt;   /* keep the reasons listen has always printed */
+    uint32_t *ids;      /* only these ids, sorted, if 'ids_len' > 0 */
+    size_t ids_len;
+    buffer *out;
+} listen_args;
+
+static const char *close_reason(uint32_t r, int plain) {
+    switch (r) {
+    case 1:  return "expired";
+    case 2:  return "dismissed";
+    case 3:  return "closed";
+    case 4:  return (plain ? "unknown reason" : "undefined");
+    default: return (plain ? "unknown reason" : "unknown");
+    }
+}
+
+static void put_json_str(buffer *buf, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    put_char(buf, '"');
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            put_char(buf, '\\');
+            put_char(buf, c);
+        } else if (c == '\n') {
+            put_strn(buf, 2, "\\n");
+        } else if (c == '\t') {
+            put_strn(buf, 2, "\\t");
+        } else if (c < 0x20) {
+            put_strn(buf, 4, "\\u00");
+            put_char(buf, hex[c >> 4]);
+            put_char(buf, hex[c & 0xf]);
+        } else {
+            put_char(buf, c);
+        }
+    }
+    put_char(buf, '"');
+}
+
+static void put_json_signal(buffer *buf, const char *event,
+                            const fmt_signal *sig) {
+    put_str(buf, "{\"event\":");
+    put_json_str(buf, event);
+    put_str(buf, ",\"id\":");
+    put_uint(buf, sig->id);
+    if (sig->reason) {
+        put_str(buf, ",\"reason\":");
+        put_json_str(buf, sig->reason);
+    }
+    if (sig->key) {
+        put_str(buf, ",\"key\":");
+        put_json_str(buf, sig->key);
+    }
+    put_char(buf, '}');
+}
+
 static int listen_callback(const gchar *signal_name,
                            GVariant *parameters, void *data) {
-    if (!strcmp(signal_name, "NotificationClosed")) {
-        GVariant *iv = g_variant_get_child_value(parameters, 0);
-        GVariant *rv = g_variant_get_child_value(parameters, 1);
-        guint32 r = g_variant_get_uint32(rv);
-        printf("closed %d (%s)\n",
-                g_variant_get_uint32(iv),
-                (r == 1 ? "expired"
-                 : r == 2 ? "dismissed"
-                 : r == 3 ? "closed"
-                 : "unknown reason"));
-        g_variant_unref(iv);
-        g_variant_unref(rv);
-    } else if (!strcmp(signal_name, "ActionInvoked")) {
-        GVariant *iv = g_variant_get_child_value(parameters, 0);
-        GVariant *av = g_variant_get_child_value(parameters, 1);
-        printf("invoked %d %s\n",
-                g_variant_get_uint32(iv),
-                g_variant_get_string(av, NULL));
-        g_variant_unref(iv);
-        g_variant_unref(av);
+    listen_args *l = data;
+    fmt_signal sig = { 0, NULL, NULL };
+    const char *event;
+    guint32 r;
+
+    if (!strcmp(signal_name, "NotificationClosed")
+            && g_variant_is_of_type(parameters, G_VARIANT_TYPE("(uu)"))) {
+        g_variant_get(parameters, "(uu)", &sig.id, &r);
+        sig.reason = close_reason(r, l->default_fmt);
+        event = "close";
+    } else if (!strcmp(signal_name, "ActionInvoked")
+            && g_variant_is_of_type(parameters, G_VARIANT_TYPE("(us)"))) {
+        g_variant_get(parameters, "(u&s)", &sig.id, &sig.key);
+        event = "invoke";
+    } else {
+        return 0;
+    }
+
+    if (l->ids_len > 0
+            && !bsearch(&sig.id, l->ids, l->ids_len, sizeof(uint32_t), cmp_id))
+        return 0;
+
+    reset_buffer(l->out);
+    if (l->json) {
+        put_json_signal(l->out, event, &sig);
     } else {
-        printf("unknown signal %s emitted\n", signal_name);
+        fmt_ctx ctx;
+        size_t i;
+        fmt_ctx_init(&ctx, &l->fmt, NULL);
+        ctx.event = event;
+        ctx.sig = &sig;
+        for (i = 0; i < l->fmt.len; i++) {
+            fmt_note_buf(l->out, &l->fmt.terms[i], &ctx);
+            if (i < l->fmt.len - 1)
+                put_char(l->out, ' ');
+        }
+        fmt_ctx_free(&ctx);
     }
+    put_char(l->out, '\n');
+
+    struct iovec iov;
+    iov.iov_base = (char *) buffer_view(l->out, &iov.iov_len);
+    output_write(&iov, 1);
     return 0;
 }
 
-extern int listen_for_signals(void) {
-    return listen(connect(), listen_callback, NULL);
+static char *default_listen_fmt[] = {
+    "%(?r:closed %i (%r))%(?k:invoked %i %k)"
+};
+
+extern int listen_for_signals(int argc, char **argv) {
+    listen_args l = { .json = 0, .ids = NULL, .ids_len = 0 };
+    char *member = NULL;
+    int i, status;
+
+    for (i = 0; i < argc; i++) {
+        char *arg = argv[i];
+        if (arg[0] != '-')
+            break;
+        if (!strcmp(arg, "--")) {
+            i++;
+            break;
+        }
+
+        if (!strcmp(arg, "--json")) {
+            l.json = 1;
+        } else if (!strcmp(arg, "--signal=close")) {
+            member = "NotificationClosed";
+        } else if (!strcmp(arg, "--signal=invoke")) {
+            member = "ActionInvoked";
+        } else if (!strncmp(arg, "--id=", 5)) {
+            long id;
+            if (!get_int(arg + 5, &id) || id < 0 || id > 0xFFFFFFFF) {
+                fprintf(stderr, "ID must be a valid value of uint32\n");
+                free(l.ids);
+                return 2;
+            }
+            l.ids = realloc(l.ids, sizeof(uint32_t) * (l.ids_len + 1));
+            l.ids[l.ids_len++] = id;
+        } else if (!strncmp(arg, "--flush=", 8)) {
+            if (!output_set_policy(arg + 8)) {
+                fprintf(stderr, "Invalid flush policy '%s'\n", arg + 8);
+                free(l.ids);
+                return 2;
+            }
+        } else {
+            fprintf(stderr, "Unrecognized option '%s'\n", arg);
+            free(l.ids);
+            return 2;
+        }
+    }
+
+    if (l.json && i < argc) {
+        fprintf(stderr, "Format arguments cannot be used with --json\n");
+        free(l.ids);
+        return 2;
+    }
+    if (i < argc)
+        l.fmt = parse_format(argc - i, argv + i);
+    else {
+        l.fmt = parse_format(1, default_listen_fmt);
+        l.default_fmt = !l.json;
+    }
+    l.ids_len = sort_ids(l.ids, l.ids_len);
+    l.out = new_buffer(BUF_LEN);
+
+    // The bus can filter by signal, but not by id.
+    status = listen(connect(), member, listen_callback, &l);
+    output_flush();
+    free_buffer(l.out);
+    free(l.ids);
+    return status;
+}
+
+extern int wait_notes(int argc, char **argv) {
+    wait_set w = { malloc(sizeof(uint32_t) * argc), 0, 1 };
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        char *end;
+        long id = strtol(argv[i], &end, 10);
+        int bad = (*argv[i] == '\0' || *end != '\0') ? 10
+                : (id < 0 || id > 0xFFFFFFFF) ? 11 : 0;
+        if (bad) {
+            free(w.ids);
+            return bad;
+        }
+        w.ids[w.len++] = id;
+    }
+
+    w.len = sort_ids(w.ids, w.len);
+
+    int status = listen(connect(), NULL, wait_callback, &w);
+    free(w.ids);
+    return status;
 }
 
 extern int invoke_action(int argc, char **argv) {
@@ -524,10 +1002,12 @@ extern int invoke_action(int argc, char **argv) {
 
     char *key = (argc > 1 ? argv[1] : "default");
 
-    GDBusProxy *proxy = make_proxy(connect());
-    GVariant *result = call(proxy, "GetCapabilities", NULL);
-    if (result == NULL)
+    bus b = open_bus();
+    GVariant *result = call(&b, "GetCapabilities", NULL);
+    if (result == NULL) {
+        wire_close(b.w);
         return 1;
+    }
     result = g_variant_get_child_value(result, 0);
 
     int got_cap = 0;
@@ -545,9 +1025,11 @@ extern int invoke_action(int argc, char **argv) {
     if (!got_cap) {
         fprintf(stderr, "Notification server does not support remote "
                         "actions\n");
+        wire_close(b.w);
         return 1;
     }
 
-    result = call(proxy, "InvokeAction", g_variant_new("(us)", id, key));
+    result = call(&b, "InvokeAction", g_variant_new("(us)", id, key));
+    wire_close(b.w);
     return (result == NULL);
 }
@@ -0,0 +1,277 @@
+/* Copyright 2025 Jack Conger */
+
+/*
+ * This file is part of notcat.
+ *
+ * notcat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notcat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with notcat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Coprocess handlers: `--on-notify=pipe:<cmd>` starts <cmd> once and streams
+ * each event to its stdin as a record of NUL-terminated KEY=VALUE fields
+ * (the same fields -e puts in the environment), ended by an empty field.
+ * If the handler exits, it is restarted with exponential backoff; events
+ * received in the meantime are held, up to COPROC_MAX_PENDING bytes.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+#include "notlib/notlib.h"
+#include "notcat.h"
+
+#define COPROC_MAX_PENDING  (4 * 1024 * 1024)
+#define BACKOFF_MIN_MS      100
+#define BACKOFF_MAX_MS      30000
+#define STABLE_US           (10 * G_USEC_PER_SEC)
+
+struct _coproc {
+    char *cmd;
+    GPid pid;           /* 0 when not running */
+    int fd;             /* -1 when not running */
+    guint out_watch;
+    guint restart_timer;
+    gint64 started;
+    guint backoff_ms;
+
+    char *pending;      /* unwritten bytes are pending[off..len] */
+    size_t off, len, cap;
+
+    struct _coproc *next;
+};
+
+static coproc *coprocs = NULL;
+
+static int coproc_start(coproc *c);
+
+static void coproc_drop_partial(coproc *c) {
+    /* A record boundary is the empty field: "\0\0". */
+    size_t i;
+    if (c->off == 0 || c->off == c->len)
+        return;
+    if (c->off >= 2 && c->pending[c->off-1] == '\0' && c->pending[c->off-2] == '\0')
+        return;
+    // Start a byte back, in case off is on the second NUL of a boundary.
+    for (i = c->off - 1; i + 1 < c->len; i++) {
+        if (c->pending[i] == '\0' && c->pending[i+1] == '\0') {
+            c->off = i + 2;
+            return;
+        }
+    }
+    c->off = c->len;
+}
+
+static gboolean coproc_restart(gpointer data) {
+    coproc *c = data;
+    c->restart_timer = 0;
+    coproc_start(c);
+    return G_SOURCE_REMOVE;
+}
+
+static void coproc_died(coproc *c) {
+    if (c->out_watch) {
+        handler_source_remove(c->out_watch);
+        c->out_watch = 0;
+    }
+    if (c->fd != -1) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    coproc_drop_partial(c);
+
+    if (g_get_monotonic_time() - c->started > STABLE_US)
+        c->backoff_ms = BACKOFF_MIN_MS;
+
+    if (!c->restart_timer) {
+        fprintf(stderr, "notcat: handler '%s' exited; restarting in %ums\n",
+                c->cmd, c->backoff_ms);
+        c->restart_timer = handler_attach(g_timeout_source_new(c->backoff_ms),
+                                          coproc_restart, c);
+    }
+
+    c->backoff_ms *= 2;
+    if (c->backoff_ms > BACKOFF_MAX_MS)
+        c->backoff_ms = BACKOFF_MAX_MS;
+}
+
+static void coproc_reap(GPid pid, gint status, gpointer data) {
+    coproc *c = data;
+    g_spawn_close_pid(pid);
+    c->pid = 0;
+    coproc_died(c);
+}
+
+static gboolean coproc_writable(gint fd, GIOCondition cond, gpointer data);
+
+static void coproc_flush(coproc *c) {
+    while (c->off < c->len) {
+        ssize_t w = write(c->fd, c->pending + c->off, c->len - c->off);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!c->out_watch)
+                    c->out_watch = handler_attach(
+                            g_unix_fd_source_new(c->fd, G_IO_OUT),
+                            (GSourceFunc) coproc_writable, c);
+                return;
+            }
+            /* EPIPE and friends: the child watch will restart it */
+            close(c->fd);
+            c->fd = -1;
+            return;
+        }
+        c->off += w;
+    }
+    c->off = c->len = 0;
+}
+
+static gboolean coproc_writable(gint fd, GIOCondition cond, gpointer data) {
+    coproc *c = data;
+    c->out_watch = 0;
+    coproc_flush(c);
+    return G_SOURCE_REMOVE;
+}
+
+static int coproc_start(coproc *c) {
+    int fds[2];
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        coproc_died(c);
+        return -1;
+    }
+
+    static char *sh = NULL;
+    if (!sh && !(sh = getenv("SHELL")))
+        sh = "/bin/sh";
+
+    char *argv[5];
+    if (shell_run_opt) {
+        argv[0] = sh;
+        argv[1] = "-c";
+        argv[2] = c->cmd;
+        argv[3] = "notcat";
+        argv[4] = NULL;
+    } else {
+        argv[0] = c->cmd;
+        argv[1] = NULL;
+    }
+
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, fds[0], 0);
+    posix_spawn_file_actions_addclose(&fa, fds[0]);
+    posix_spawn_file_actions_addclose(&fa, fds[1]);
+
+    /* we ignore SIGPIPE, but the handler shouldn't */
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGPIPE);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    extern char **environ;
+    int err = posix_spawnp(&c->pid, argv[0], &fa, &attr, argv, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+    close(fds[0]);
+
+    c->started = g_get_monotonic_time();
+    if (err) {
+        errno = err;
+        perror(argv[0]);
+        close(fds[1]);
+        c->pid = 0;
+        coproc_died(c);
+        return -1;
+    }
+
+    c->fd = fds[1];
+    fcntl(c->fd, F_SETFD, FD_CLOEXEC);
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+    handler_attach(g_child_watch_source_new(c->pid),
+                   (GSourceFunc) coproc_reap, c);
+
+    coproc_flush(c);
+    return 0;
+}
+
+extern coproc *coproc_for(char *cmd) {
+    coproc *c;
+    for (c = coprocs; c; c = c->next)
+        if (!strcmp(c->cmd, cmd))
+            return c;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    c = calloc(1, sizeof(coproc));
+    c->cmd = cmd;
+    c->fd = -1;
+    c->backoff_ms = BACKOFF_MIN_MS;
+    c->next = coprocs;
+    coprocs = c;
+
+    coproc_start(c);
+    return c;
+}
+
+extern void coproc_send(coproc *c, fmt_ctx *ctx) {
+    static buffer *buf = NULL;
+    if (!buf)
+        buf = new_buffer(BUF_LEN);
+    reset_buffer(buf);
+
+    put_note_fields(buf, ctx);
+    put_char(buf, '\0');
+
+    size_t len;
+    const char *rec = buffer_view(buf, &len);
+
+    if (c->len - c->off + len > COPROC_MAX_PENDING) {
+        fprintf(stderr, "notcat: handler '%s' is not keeping up; "
+                "dropping %s event\n", c->cmd, ctx->event);
+        return;
+    }
+
+    if (c->off > 0 && c->len + len > c->cap) {
+        memmove(c->pending, c->pending + c->off, c->len - c->off);
+        c->len -= c->off;
+        c->off = 0;
+    }
+    if (c->len + len > c->cap) {
+        c->cap = (c->len + len) * 2;
+        c->pending = realloc(c->pending, c->cap);
+    }
+    memcpy(c->pending + c->len, rec, len);
+    c->len += len;
+
+    if (c->fd != -1 && !c->out_watch)
+        coproc_flush(c);
+}
+
+/* vim: set ft=c tabstop=4 softtabstop=4 shiftwidth=4 expandtab textwidth=0: */
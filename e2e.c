@@ -0,0 +1,405 @@
+/* Copyright 2025 Jack Conger */
+
+/*
+ * This file is part of notcat.
+ *
+ * notcat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notcat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with notcat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * notcat-bench: end-to-end latency of a running notcat.
+ *
+ * Starts a private session bus and a notcat on it, then sends
+ * notifications at a series of fixed rates through the same code as
+ * `notcat send`.  Each summary carries a sequence number, and a
+ * notification's latency is the time from when it was due to be sent
+ * (not when the sender got around to it, which may be later under load)
+ * until its line shows up on notcat's standard output, whether written by
+ * the built-in echo or by a handler.
+ *
+ *   notcat-bench [--notcat=<path>] [--handler=echo|spawn|pipe]
+ *                [--rates=<n>,<n>...] [--count=<n>] [--slo=<ms>]
+ *                [-- <notcat options>...]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include <gio/gio.h>
+
+#include "notcat.h"
+
+#define MARK "@@"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)t;
+    ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/*
+ * Per-notification timestamps, indexed by sequence number.  'seen' is
+ * written by the reader thread, under 'lock'.
+ */
+static double *due = NULL;
+static double *seen = NULL;
+static size_t seq_len = 0;
+static size_t seen_count = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t seen_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Like strstr(p, MARK), but up to 'end' rather than the first NUL: pipe:
+ * handlers are sent NUL-separated fields.  *end must be '\0'.
+ */
+static char *find_mark(char *p, char *end) {
+    while ((p = memchr(p, MARK[0], end - p)) != NULL) {
+        if (p[1] == MARK[1])
+            return p;
+        p++;
+    }
+    return NULL;
+}
+
+/* Finds MARK<seq>MARK in notcat's output, however it is formatted. */
+static void *reader(void *arg) {
+    int fd = *(int *)arg;
+    char buf[65536 + 1];
+    size_t len = 0;
+
+    for (;;) {
+        ssize_t r = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return NULL;
+        double t = now();
+        len += r;
+        buf[len] = '\0';
+
+        char *p = buf, *keep = NULL;
+        while ((p = find_mark(p, buf + len)) != NULL) {
+            char *end;
+            unsigned long seq = strtoul(p + 2, &end, 10);
+            if (end == buf + len || (*end == MARK[0] && end + 1 == buf + len)) {
+                keep = p;   /* the rest is yet to be read */
+                break;
+            }
+            if (end == p + 2 || strncmp(end, MARK, 2)) {
+                p++;
+                continue;
+            }
+
+            pthread_mutex_lock(&lock);
+            if (seq < seq_len && seen[seq] == 0) {
+                seen[seq] = t;
+                seen_count++;
+                pthread_cond_signal(&seen_cond);
+            }
+            pthread_mutex_unlock(&lock);
+            p = end + 2;
+        }
+
+        if (keep == NULL)
+            keep = buf + len - (buf[len - 1] == MARK[0]);
+        if (keep == buf && len == sizeof(buf) - 1)
+            keep = buf + len;   /* no marker is this long */
+        len = buf + len - keep;
+        memmove(buf, keep, len);
+    }
+}
+
+static pid_t spawn_with_stdout(char **argv, int out_fd) {
+    extern char **environ;
+    posix_spawn_file_actions_t fa;
+    pid_t pid;
+    int err;
+
+    posix_spawn_file_actions_init(&fa);
+    if (out_fd != -1)
+        posix_spawn_file_actions_adddup2(&fa, out_fd, STDOUT_FILENO);
+    err = posix_spawnp(&pid, argv[0], &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+
+    if (err) {
+        errno = err;
+        perror(argv[0]);
+        return -1;
+    }
+    return pid;
+}
+
+/* Starts a private session bus, and points DBUS_SESSION_BUS_ADDRESS at it. */
+static pid_t start_bus(void) {
+    int fds[2];
+    char fd_arg[32], addr[1024];
+    size_t len = 0;
+
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    snprintf(fd_arg, sizeof(fd_arg), "--print-address=%d", fds[1]);
+    char *argv[] = {"dbus-daemon", "--session", "--nofork", fd_arg, NULL};
+
+    pid_t pid = spawn_with_stdout(argv, -1);
+    close(fds[1]);
+    if (pid == -1)
+        return -1;
+
+    while (len < sizeof(addr) - 1) {
+        ssize_t r = read(fds[0], addr + len, sizeof(addr) - 1 - len);
+        if (r <= 0)
+            break;
+        len += r;
+        if (memchr(addr, '\n', len))
+            break;
+    }
+    close(fds[0]);
+    addr[len] = '\0';
+    addr[strcspn(addr, "\n")] = '\0';
+    if (len == 0) {
+        fprintf(stderr, "notcat-bench: dbus-daemon gave no address\n");
+        return -1;
+    }
+
+    setenv("DBUS_SESSION_BUS_ADDRESS", addr, 1);
+    return pid;
+}
+
+static int wait_for_server(void) {
+    GDBusConnection *conn = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+    int i;
+    if (conn == NULL)
+        return -1;
+
+    for (i = 0; i < 500; i++) {
+        GVariant *r = g_dbus_connection_call_sync(conn,
+                "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                "org.freedesktop.DBus", "NameHasOwner",
+                g_variant_new("(s)", "org.freedesktop.Notifications"),
+                G_VARIANT_TYPE("(b)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
+        if (r != NULL) {
+            gboolean owned;
+            g_variant_get(r, "(b)", &owned);
+            g_variant_unref(r);
+            if (owned)
+                return 0;
+        }
+        sleep_until(now() + 0.01);
+    }
+    fprintf(stderr, "notcat-bench: notcat never took the bus name\n");
+    return -1;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Sends 'count' notifications at 'rate'/s.  Returns 1 if within the SLO. */
+static int run_rate(long rate, size_t count, double slo_ms, size_t base) {
+    char summary[64];
+    char *argv[] = {"-a", "notcat-bench", "--", summary, "body", NULL};
+    size_t i;
+
+    double start = now() + 0.01;
+    for (i = 0; i < count; i++) {
+        size_t seq = base + i;
+        uint32_t id;
+
+        due[seq] = start + (double)i / rate;
+        sleep_until(due[seq]);
+        snprintf(summary, sizeof(summary), MARK "%zu" MARK, seq);
+        if (send_note_args(5, argv, &id) != 0)
+            return -1;
+    }
+    double sent_rate = count / (now() - start);
+
+    /* give stragglers a moment */
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 5;
+    pthread_mutex_lock(&lock);
+    while (seen_count < base + count) {
+        if (pthread_cond_timedwait(&seen_cond, &lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+
+    double *lat = malloc(sizeof(double) * count);
+    size_t n = 0;
+    for (i = 0; i < count; i++) {
+        if (seen[base + i] != 0)
+            lat[n++] = (seen[base + i] - due[base + i]) * 1e3;
+    }
+    pthread_mutex_unlock(&lock);
+
+    size_t lost = count - n;
+    double p50 = 0, p99 = 0, p999 = 0;
+    if (n > 0) {
+        qsort(lat, n, sizeof(double), cmp_double);
+        p50 = lat[n / 2];
+        p99 = lat[n * 99 / 100];
+        p999 = lat[n * 999 / 1000];
+    }
+    free(lat);
+
+    printf("%8ld %8.0f %10.3f %10.3f %10.3f %6zu\n",
+           rate, sent_rate, p50, p99, p999, lost);
+    fflush(stdout);
+
+    return (lost == 0 && sent_rate >= rate * 0.95 && p99 <= slo_ms);
+}
+
+static void usage(char *arg0, int code) {
+    fprintf(stderr, "Usage:\n"
+            "  %s [--notcat=<path>] [--handler=echo|spawn|pipe] \\\n"
+            "     [--rates=<n>,<n>...] [--count=<n>] [--slo=<ms>] \\\n"
+            "     [-- <notcat options>...]\n"
+            "\n"
+            "Sends notifications to a notcat on a private bus at each rate in\n"
+            "turn, and reports latency percentiles in milliseconds.\n",
+            arg0);
+    exit(code);
+}
+
+int main(int argc, char **argv) {
+    char *notcat = "./notcat";
+    char *handler = "echo";
+    char *rates_opt = "100,300,1000,3000,10000,30000";
+    size_t count = 2000;
+    double slo_ms = 10;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        char *arg = argv[i];
+        if (!strcmp(arg, "--")) {
+            i++;
+            break;
+        } else if (!strncmp(arg, "--notcat=", 9)) {
+            notcat = arg + 9;
+        } else if (!strncmp(arg, "--handler=", 10)) {
+            handler = arg + 10;
+        } else if (!strncmp(arg, "--rates=", 8)) {
+            rates_opt = arg + 8;
+        } else if (!strncmp(arg, "--count=", 8)) {
+            count = strtoul(arg + 8, NULL, 10);
+        } else if (!strncmp(arg, "--slo=", 6)) {
+            slo_ms = strtod(arg + 6, NULL);
+        } else if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+            usage(argv[0], 0);
+        } else {
+            usage(argv[0], 2);
+        }
+    }
+    if (count == 0)
+        usage(argv[0], 2);
+
+    /* notcat's command line: handler options, then the user's, then format */
+    char **nargv = malloc(sizeof(char *) * (argc - i + 5));
+    int nargc = 0;
+    nargv[nargc++] = notcat;
+    if (!strcmp(handler, "spawn")) {
+        nargv[nargc++] = "--on-notify=/bin/echo";
+    } else if (!strcmp(handler, "pipe")) {
+        nargv[nargc++] = "--on-notify=pipe:cat";
+    } else if (strcmp(handler, "echo")) {
+        usage(argv[0], 2);
+    }
+    for (; i < argc; i++)
+        nargv[nargc++] = argv[i];
+    nargv[nargc++] = "--";
+    nargv[nargc++] = "%s";
+    nargv[nargc] = NULL;
+
+    long rates[64];
+    size_t rates_len = 0;
+    char *r = rates_opt;
+    while (*r && rates_len < sizeof(rates) / sizeof(rates[0])) {
+        rates[rates_len] = strtol(r, &r, 10);
+        if (rates[rates_len] <= 0)
+            usage(argv[0], 2);
+        rates_len++;
+        if (*r == ',')
+            r++;
+        else if (*r)
+            usage(argv[0], 2);
+    }
+
+    seq_len = count * rates_len;
+    due = calloc(seq_len, sizeof(double));
+    seen = calloc(seq_len, sizeof(double));
+
+    pid_t bus = start_bus();
+    if (bus == -1)
+        return 1;
+
+    int fds[2];
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        return 1;
+    }
+    pid_t server = spawn_with_stdout(nargv, fds[1]);
+    close(fds[1]);
+
+    int status = 1;
+    pthread_t thread;
+    if (server != -1 && wait_for_server() == 0 &&
+            pthread_create(&thread, NULL, reader, &fds[0]) == 0) {
+        long sustained = 0;
+        size_t k;
+
+        printf("# handler=%s count=%zu slo=%gms\n", handler, count, slo_ms);
+        printf("%8s %8s %10s %10s %10s %6s\n",
+               "rate/s", "sent/s", "p50 ms", "p99 ms", "p99.9 ms", "lost");
+        for (k = 0; k < rates_len; k++) {
+            int ok = run_rate(rates[k], count, slo_ms, k * count);
+            if (ok == -1)
+                break;
+            if (ok == 1 && rates[k] > sustained)
+                sustained = rates[k];
+        }
+        printf("sustained: %ld events/s\n", sustained);
+        status = 0;
+    }
+
+    if (server != -1) {
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+    }
+    kill(bus, SIGTERM);
+    waitpid(bus, NULL, 0);
+    return status;
+}
+
+/* vim: set ft=c tabstop=4 softtabstop=4 shiftwidth=4 expandtab textwidth=0: */
@@ -25,10 +25,7 @@
 #include <stdbool.h>
 
 #include "notlib/notlib.h"
-#include "notcat.h"
-
-format fmt;
-char *current_event = "ERROR";
+#include "libnotcat.h"
 
 extern char *str_urgency(const enum NLUrgency u) {
     switch (u) {
@@ -40,174 +37,321 @@ extern char *str_urgency(const enum NLUrgency u) {
     }
 }
 
-static void put_urgency(buffer *buf, const enum NLUrgency u) {
-    put_str(buf, str_urgency(u));
+static void fmt_body(const char *in, char *out) {
+    const char *e;
+    size_t j = 0;
+    bool last_n = false;
+    while (*in) {
+        if (*in == '\n') {
+            if (!last_n)
+                out[j++] = ' ';
+            last_n = true;
+            in++;
+            continue;
+        }
+        e = scan(in, '\n', '\n', '\n');
+        memcpy(out + j, in, e - in);
+        j += e - in;
+        in = e;
+        last_n = false;
+    }
+    out[j] = '\0';
 }
 
-static void put_uint(buffer *buf, uint32_t u) {
-    if (u == 0) {
-        put_char(buf, '0');
-        return;
-    }
+static char *empty_body = "";
 
-    char chs[10] = {0, 0, 0, 0, 0};
-    size_t idx;
-    for (idx = 9; u > 0; idx--) {
-        chs[idx] = '0' + (u % 10);
-        u /= 10;
-    }
+/* Marks a hint slot which has been looked up and found missing. */
+static char no_hint[] = "";
+
+extern void fmt_ctx_init(fmt_ctx *ctx, const format *f, const NLNote *n) {
+    ctx->fmt = f;
+    ctx->event = NULL;
+    ctx->n = n;
+    ctx->copy = NULL;
+    ctx->sig = NULL;
+    ctx->body = NULL;
+    ctx->scratch = NULL;
+    if (f->hints_len <= CTX_INLINE_HINTS)
+        ctx->hints = ctx->inline_hints;
+    else
+        ctx->hints = malloc(sizeof(char *) * f->hints_len);
+    memset(ctx->hints, 0, sizeof(char *) * f->hints_len);
+}
+
+extern void fmt_ctx_init_copy(fmt_ctx *ctx, const format *f,
+                              const note_copy *c) {
+    fmt_ctx_init(ctx, f, &c->n);
+    ctx->copy = c;
+}
+
+static char *dup_str(const char *s) {
+    if (s == NULL)
+        return NULL;
+    size_t len = strlen(s) + 1;
+    return memcpy(malloc(len), s, len);
+}
 
-    for (idx = 0; idx < 10; idx++) {
-        if (chs[idx] != 0)
-            put_char(buf, chs[idx]);
+/*
+ * Copies a note notcat made up itself: only n's own fields are read, and
+ * the copy has no hints or actions.
+ */
+extern note_copy *copy_bare_note(const format *f, const NLNote *n) {
+    size_t len = f->hints_len + f->actions_len;
+    note_copy *c = malloc(sizeof(note_copy) + sizeof(char *) * len);
+
+    // Only the fields we read are set; notlib's own stay zero.
+    memset(&c->n, 0, sizeof(NLNote));
+    c->n.id = n->id;
+    c->n.appname = dup_str(n->appname);
+    c->n.summary = dup_str(n->summary);
+    c->n.body = dup_str(n->body);
+    c->n.timeout = n->timeout;
+    c->n.urgency = n->urgency;
+
+    c->hints = c->fields;
+    c->actions = c->fields + f->hints_len;
+    memset(c->fields, 0, sizeof(char *) * len);
+    return c;
+}
+
+extern note_copy *copy_note(const format *f, const NLNote *n) {
+    note_copy *c = copy_bare_note(f, n);
+    size_t i;
+
+    for (i = 0; i < f->hints_len; i++)
+        c->hints[i] = nl_get_hint_as_string(n, f->hints[i]);
+    for (i = 0; i < f->actions_len; i++)
+        c->actions[i] = dup_str(nl_action_name(n, f->actions[i]));
+    return c;
+}
+
+extern void free_note_copy(note_copy *c, const format *f) {
+    size_t i;
+    if (c == NULL)
+        return;
+    for (i = 0; i < f->hints_len + f->actions_len; i++)
+        free(c->fields[i]);
+    free((char *) c->n.appname);
+    free((char *) c->n.summary);
+    free((char *) c->n.body);
+    free(c);
+}
+
+extern void fmt_ctx_free(fmt_ctx *ctx) {
+    size_t i;
+    for (i = 0; i < ctx->fmt->hints_len; i++) {
+        if (ctx->hints[i] != NULL && ctx->hints[i] != no_hint)
+            free(ctx->hints[i]);
     }
+    if (ctx->hints != ctx->inline_hints)
+        free(ctx->hints);
+    if (ctx->body != NULL && ctx->body != empty_body && ctx->scratch == NULL)
+        free(ctx->body);
 }
 
-static void put_int(buffer *buf, int32_t i) {
-    if (i < 0) {
-        put_char(buf, '-');
-        put_uint(buf, UINT32_MAX - (uint32_t) i + 1);
+extern const char *fmt_ctx_body(fmt_ctx *ctx) {
+    const NLNote *n = ctx->n;
+    if (ctx->body != NULL)
+        return ctx->body;
+    if (n == NULL || n->body == NULL)
+        return (ctx->body = empty_body);
+
+    size_t len = strlen(n->body);
+    if (ctx->scratch != NULL) {
+        reset_buffer(ctx->scratch);
+        ctx->body = buffer_reserve(ctx->scratch, len);
     } else {
-        put_uint(buf, i);
+        ctx->body = malloc(1 + len);
     }
+    if (markup_body(n->body, ctx->body) == -1)
+        fmt_body(n->body, ctx->body);
+    return ctx->body;
 }
 
-static void fmt_body(const char *in, char *out) {
-    size_t i, j = 0;
-    char c;
-    bool last_n = false;
-    for (i = 0; (c = in[i]); ++i) {
-        switch (c) {
-        case '\n':
-            if (!last_n)
-                out[j++] = ' ';
-            last_n = true;
-            break;
-        default:
-            last_n = false;
-            out[j++] = c;
-        }
+extern const char *fmt_ctx_hint(fmt_ctx *ctx, size_t slot) {
+    if (ctx->copy != NULL)
+        return ctx->copy->hints[slot];
+    if (ctx->hints[slot] == NULL) {
+        char *h = NULL;
+        if (ctx->n != NULL)
+            h = nl_get_hint_as_string(ctx->n, ctx->fmt->hints[slot]);
+        ctx->hints[slot] = (h ? h : no_hint);
     }
-    out[j] = '\0';
+    return (ctx->hints[slot] == no_hint ? NULL : ctx->hints[slot]);
+}
+
+extern const char *fmt_ctx_action(fmt_ctx *ctx, size_t i) {
+    if (ctx->copy != NULL)
+        return ctx->copy->actions[i];
+    if (ctx->n == NULL)
+        return NULL;
+    return nl_action_name(ctx->n, ctx->fmt->actions[i]);
+}
+
+/*
+ * The interpreter writes either into a buffer, copying, or into an iovec
+ * list, referencing the note's strings in place.  Only integers need to be
+ * rendered, and in the iovec case they go into space reserved up front by
+ * fmt_iov_reset(), so no pointer handed out is ever moved by a realloc.
+ */
+
+typedef struct {
+    buffer *buf;
+    fmt_iov *v;
+} fmt_out;
+
+extern void fmt_iov_init(fmt_iov *v) {
+    v->iov = NULL;
+    v->len = v->cap = 0;
+    v->nums = new_buffer(BUF_LEN);
+    v->nums_cur = NULL;
+}
+
+extern void fmt_iov_reset(fmt_iov *v, const format *f) {
+    size_t i, ops = 0;
+    for (i = 0; i < f->len; i++)
+        ops += f->terms[i].len;
+
+    v->len = 0;
+    reset_buffer(v->nums);
+    v->nums_cur = buffer_reserve(v->nums, 11 * ops);  /* "-2147483648" */
 }
 
-static void put_hint(buffer *buf, const NLNote *n, const char *name) {
-    char *hs;
-    if (!(hs = nl_get_hint_as_string(n, name)))
+extern void fmt_iov_push(fmt_iov *v, const char *s, size_t len) {
+    if (len == 0)
         return;
-    put_str(buf, hs);
-    free(hs);
+    if (v->len == v->cap) {
+        v->cap = (v->cap ? v->cap * 2 : 16);
+        v->iov = realloc(v->iov, sizeof(struct iovec) * v->cap);
+    }
+    v->iov[v->len].iov_base = (void *)s;
+    v->iov[v->len].iov_len = len;
+    v->len++;
+}
+
+static void emit(fmt_out *o, const char *s, size_t len) {
+    if (o->buf)
+        put_strn(o->buf, len, s);
+    else
+        fmt_iov_push(o->v, s, len);
+}
+
+static void emit_str(fmt_out *o, const char *s) {
+    emit(o, s, strlen(s));
 }
 
-static void put_action(buffer *buf, const NLNote *n, const char *key) {
-    const char *an;
-    if (!(an = nl_action_name(n, key)))
+static void emit_uint(fmt_out *o, uint32_t u) {
+    if (o->buf) {
+        put_uint(o->buf, u);
         return;
-    put_str(buf, an);
+    }
+    char tmp[10];
+    size_t len = fmt_uint(tmp, u);
+    memcpy(o->v->nums_cur, tmp + 10 - len, len);
+    fmt_iov_push(o->v, o->v->nums_cur, len);
+    o->v->nums_cur += len;
 }
 
-#define NORMAL      0
-#define PCT         1
-#define PCTPAREN    2
-#define HINT        3
-#define ACTION      4
+static void emit_int(fmt_out *o, int32_t i) {
+    if (i < 0) {
+        emit(o, "-", 1);
+        emit_uint(o, UINT32_MAX - (uint32_t) i + 1);
+    } else {
+        emit_uint(o, i);
+    }
+}
 
-static char *empty_body = "";
+static int test_cond(const fmt_op *op, fmt_ctx *ctx) {
+    const NLNote *n = ctx->n;
+    if (op->chr == 'r')
+        return (ctx->sig && ctx->sig->reason);
+    if (op->chr == 'k')
+        return (ctx->sig && ctx->sig->key);
+    if (!n)
+        return 0;
 
-extern void fmt_note_buf(buffer *buf, fmt_term *fmt, const NLNote *n) {
-    size_t i;
-    char *body;
+    switch (op->chr) {
+    case 'a': return (n->appname && n->appname[0]);
+    case 's': return (n->summary && n->summary[0]);
+    case 'b': return (n->body && n->body[0]);
+    case 'B': return (n->body && n->body[0] && fmt_ctx_body(ctx)[0]);
+    case 't': return (n->timeout >= 0);
+    case 'c': return (fmt_ctx_hint(ctx, op->slot) != NULL);
+    case 'u': return (n->urgency != URG_NORM);
+    default:  return 1;
+    }
+}
 
-    for (i = 0; i < fmt->len; i++) {
-        fmt_item *item = &(fmt->items[i]);
-        body = NULL;
+static void fmt_emit(fmt_out *o, const fmt_term *fmt, fmt_ctx *ctx) {
+    const fmt_op *op, *end = fmt->ops + fmt->len;
+    const NLNote *n = ctx->n;
+    const char *h;
 
-        switch (item->type) {
+    for (op = fmt->ops; op < end; op++) {
+        switch (op->type) {
+        case OP_LITERAL:
+            emit(o, op->str, op->len);
+            break;
+        case OP_COND:
+            if (!test_cond(op, ctx))
+                op += op->len;
+            break;
         case 'i':
-            if (n) put_uint(buf, n->id);
+            if (n) emit_uint(o, n->id);
+            else if (ctx->sig) emit_uint(o, ctx->sig->id);
             break;
         case 'a':
-            if (n && n->appname) put_str(buf, n->appname);
+            if (n && n->appname) emit_str(o, n->appname);
             break;
         case 's':
-            if (n && n->summary) put_str(buf, n->summary);
+            if (n && n->summary) emit_str(o, n->summary);
             break;
         case 'b':
-            if (n && n->body) put_str(buf, n->body);
+            if (n && n->body) emit_str(o, n->body);
             break;
         case 'B':
-            if (!n) break;
-            if (body == NULL) {
-                body = (n->body == NULL ? empty_body : malloc(1 + strlen(n->body)));
-                if (markup_body(n->body, body) == -1)
-                    fmt_body(n->body, body);
-            }
-            put_str(buf, body);
+            if (n) emit_str(o, fmt_ctx_body(ctx));
             break;
         case 't':
-            if (n) put_int(buf, n->timeout);
+            if (n) emit_int(o, n->timeout);
             break;
         case 'u':
-            if (n) put_urgency(buf, n->urgency);
+            if (n) emit_str(o, str_urgency(n->urgency));
             break;
-        case 'c':
-            put_hint(buf, n, "category");
+        case 'c': case 'h':
+            if ((h = fmt_ctx_hint(ctx, op->slot))) emit_str(o, h);
             break;
         case 'n':
-            put_str(buf, current_event);
-            break;
-        case 'A':
-            put_action(buf, n, item->str);
+            if (ctx->event) emit_str(o, ctx->event);
             break;
-        case 'h':
-            put_hint(buf, n, item->str);
+        case 'r':
+            if (ctx->sig && ctx->sig->reason) emit_str(o, ctx->sig->reason);
             break;
-        case ITEM_TYPE_LITERAL:
-            put_str(buf, item->str);
+        case 'k':
+            if (ctx->sig && ctx->sig->key) emit_str(o, ctx->sig->key);
             break;
-        case ITEM_TYPE_CONDITIONAL: {
-            char cond = 0;
-            switch (item->chr) {
-            case 'a': if (n && n->appname && n->appname[0]) cond = 1; break;
-            case 's': if (n && n->summary && n->summary[0]) cond = 1; break;
-            case 'b': if (n && n->body && n->body[0]) cond = 1; break;
-            case 'B': if (n && n->body && n->body[0]) cond = 2; break; /* 2! */
-            case 't': if (n && n->timeout >= 0) cond = 1; break;
-            case 'c': {
-                char *c = nl_get_hint_as_string(n, "category");
-                if (c) {
-                    cond = 1;
-                    free(c);
-                }
-                break;
-            }
-            case 'u': if (n && n->urgency != URG_NORM) cond = 1; break;
-            default:  if (n) cond = 1; break;
-            }
-            if (cond == 2) {
-                if (body == NULL && n != NULL) {
-                    body = (n->body == NULL ? empty_body : malloc(1 + strlen(n->body)));
-                    if (markup_body(n->body, body) == -1)
-                        fmt_body(n->body, body);
-                }
-                cond = (body && body[0] ? 1 : 0);
-            }
-            if (cond == 1)
-                fmt_note_buf(buf, &item->subterm, n);
+        case 'A':
+            if ((h = fmt_ctx_action(ctx, op->slot))) emit_str(o, h);
             break;
-        }
         default:
             exit(59);
         }
-
-        if (body != NULL && body != empty_body)
-            free(body);
     }
 }
 
-extern char *fmt_note(fmt_term *fmt, const NLNote *n) {
+extern void fmt_note_buf(buffer *buf, const fmt_term *fmt, fmt_ctx *ctx) {
+    fmt_out o = {buf, NULL};
+    fmt_emit(&o, fmt, ctx);
+}
+
+extern void fmt_note_iov(fmt_iov *v, const fmt_term *fmt, fmt_ctx *ctx) {
+    fmt_out o = {NULL, v};
+    fmt_emit(&o, fmt, ctx);
+}
+
+extern char *fmt_note(const fmt_term *fmt, fmt_ctx *ctx) {
     buffer *buf = new_buffer(BUF_LEN);
-    fmt_note_buf(buf, fmt, n);
+    fmt_note_buf(buf, fmt, ctx);
     return dump_buffer(buf);
 }
 
@@ -0,0 +1,185 @@
+/* Copyright 2025 Jack Conger */
+
+/*
+ * This file is part of notcat.
+ *
+ * notcat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notcat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with notcat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * libnotcat: compiling formats and rendering notifications with them.
+ *
+ * A format is compiled once by parse_format(), and is only read after
+ * that.  Each event is rendered through a fmt_ctx of its own, which holds
+ * everything derived from the note along the way.  Nothing here keeps any
+ * other state, so any number of threads can render with the same format at
+ * once, as long as each uses its own fmt_ctx, fmt_iov and buffers.  The
+ * one exception is scan_select(), which should be called, if at all, before
+ * any rendering starts.
+ */
+
+#ifndef LIBNOTCAT_H
+#define LIBNOTCAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "notlib/notlib.h"
+
+// buffer.c
+
+#define BUF_LEN 512
+
+typedef struct _buffer buffer;
+
+extern buffer *new_buffer(size_t);
+extern void reset_buffer(buffer *buf);
+extern void free_buffer(buffer *buf);
+extern size_t buffer_len(buffer *buf);
+extern const char *buffer_view(buffer *buf, size_t *len);
+extern char *buffer_reserve(buffer *buf, size_t cn);
+extern char *dump_buffer(buffer *buf);
+
+extern void put_strn(buffer *, size_t, const char *);
+extern void put_str (buffer *, const char *);
+extern void put_char(buffer *, char);
+extern void put_uint(buffer *, uint32_t);
+extern void put_int (buffer *, int32_t);
+
+extern size_t fmt_uint(char tmp[10], uint32_t u);
+
+// parse.c
+
+/*
+ * A compiled term is a flat array of ops.  Most op types are the format
+ * sequence character itself ('i', 'a', 's', ...).
+ */
+#define OP_LITERAL  128  /* 'len' bytes of text held in 'str' */
+#define OP_COND     129  /* if 'chr' is unset, skip the next 'len' ops */
+
+#define HINT_SLOT_CATEGORY 0  /* always interned */
+
+typedef struct _fmt_op {
+    unsigned char type;
+    char chr;
+    size_t len;
+    char *str;      /* literal text, action key, or interned hint name */
+    size_t slot;    /* index into the format's hints for 'c' and 'h', or
+                       its actions for 'A' */
+} fmt_op;
+
+typedef struct _fmt_term {
+    size_t len;
+    fmt_op *ops;
+} fmt_term;
+
+typedef struct _format {
+    size_t len;
+    fmt_term *terms;
+    size_t hints_len;
+    char **hints;
+    size_t actions_len;
+    char **actions;     /* action keys used by %(A:KEY) */
+} format;
+
+extern format parse_format(size_t len, char **str);
+extern void free_format(format *fmt);
+
+// fmt.c
+
+#define CTX_INLINE_HINTS 8
+
+/* The fields of a signal seen by 'listen', which has no note. */
+typedef struct _fmt_signal {
+    uint32_t id;
+    const char *reason;     /* NotificationClosed */
+    const char *key;        /* ActionInvoked */
+} fmt_signal;
+
+/*
+ * An owned copy of a note, for events which outlive notlib's callback: the
+ * note's own fields, and the hints and action names a format refers to,
+ * looked up in advance.
+ */
+typedef struct _note_copy {
+    NLNote n;
+    char **hints;       /* indexed by hint slot; NULL if missing */
+    char **actions;     /* indexed like the format's actions */
+    char *fields[];
+} note_copy;
+
+extern note_copy *copy_note(const format *fmt, const NLNote *n);
+extern note_copy *copy_bare_note(const format *fmt, const NLNote *n);
+extern void free_note_copy(note_copy *c, const format *fmt);
+
+/*
+ * Per-event evaluation state.  Derived fields (the cooked body and each
+ * stringified hint) are computed at most once per event, and shared by
+ * every term formatted with the same context.  If 'scratch' is set, the
+ * cooked body is kept there instead of in a fresh allocation; the buffer
+ * must not be otherwise used until fmt_ctx_free().
+ */
+typedef struct _fmt_ctx {
+    const format *fmt;
+    const char *event;  /* "notify", "close", ...; set by the caller */
+    const NLNote *n;
+    const note_copy *copy;
+    const fmt_signal *sig;
+    char *body;
+    buffer *scratch;
+    char **hints;   /* indexed by hint slot */
+    char *inline_hints[CTX_INLINE_HINTS];
+} fmt_ctx;
+
+extern void fmt_ctx_init(fmt_ctx *ctx, const format *fmt, const NLNote *n);
+extern void fmt_ctx_init_copy(fmt_ctx *ctx, const format *fmt,
+                              const note_copy *c);
+extern void fmt_ctx_free(fmt_ctx *ctx);
+extern const char *fmt_ctx_body(fmt_ctx *ctx);
+extern const char *fmt_ctx_hint(fmt_ctx *ctx, size_t slot);
+extern const char *fmt_ctx_action(fmt_ctx *ctx, size_t i);
+
+/*
+ * A list of pieces of formatted output, pointing into the note, the format
+ * and the fmt_ctx wherever possible.  Valid until the fmt_ctx is freed or
+ * the list is reset.
+ */
+typedef struct _fmt_iov {
+    struct iovec *iov;
+    size_t len, cap;
+    buffer *nums;   /* storage for rendered integers */
+    char *nums_cur;
+} fmt_iov;
+
+extern void fmt_iov_init(fmt_iov *v);
+extern void fmt_iov_reset(fmt_iov *v, const format *fmt);
+extern void fmt_iov_push(fmt_iov *v, const char *s, size_t len);
+
+extern char *str_urgency(const enum NLUrgency urgency);
+extern void fmt_note_buf(buffer *buf, const fmt_term *fmt, fmt_ctx *ctx);
+extern void fmt_note_iov(fmt_iov *v, const fmt_term *fmt, fmt_ctx *ctx);
+extern char *fmt_note(const fmt_term *fmt, fmt_ctx *ctx);
+
+// markup.c
+
+extern int markup_body(const char *in, char *out);
+
+// scan.c
+
+extern const char *scan(const char *s, char a, char b, char c);
+extern int scan_select(const char *name);
+extern const char *scan_name(void);
+
+#endif
@@ -0,0 +1,270 @@
+/* Copyright 2025 Jack Conger */
+
+/*
+ * This file is part of notcat.
+ *
+ * notcat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notcat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with notcat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Per-application rate limits, as token buckets.
+ *
+ *  --rate-limit=<n>/<seconds>  handle up to n notifications from each app
+ *                              per <seconds>
+ *  --rate-burst=<n>            let an idle app send up to n at once
+ *                              (default: the n of --rate-limit)
+ *  --rate-by=app|category      one bucket per app, or per app and
+ *                              "category" hint
+ *  --rate-over=drop|summarize|defer
+ *                              what to do with notifications over the limit
+ *
+ * Handling a notification takes a token from its bucket.  Over the limit,
+ * a notification is dropped; with summarize, the bucket also counts what
+ * it drops, and once it has a token again it hands the count to the
+ * summary callback.  With defer, notifications wait in their bucket and are
+ * handed to the release callback, in order, as tokens come back.
+ *
+ * A notification's close goes with it: limit_close() says to skip it only
+ * when every notify for the id was shed.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "notlib/notlib.h"
+#include "notcat.h"
+
+#define ID_HANDLED  1
+#define ID_SHED     2
+
+typedef struct _bucket {
+    char *app, *category;
+    double tokens;
+    gint64 last;        /* monotonic time tokens was last brought up to */
+    guint timer;
+    GQueue deferred;
+    unsigned long suppressed;   /* dropped since the last summary */
+    unsigned long dropped, deferred_total, summaries;
+} bucket;
+
+static double rate = 0;         /* tokens per microsecond; 0 for no limit */
+static double burst = 0;
+static int by_category = 0;
+static int over = LIMIT_DROP;
+
+static GHashTable *buckets = NULL;
+static GHashTable *ids = NULL;  /* id => ID_HANDLED or ID_SHED */
+static int (*release_cb)(void *item) = NULL;
+static void (*summary_cb)(const char *app, const char *category,
+                          unsigned long count) = NULL;
+
+extern int limit_set_rate(const char *spec) {
+    char *end;
+    unsigned long n = strtoul(spec, &end, 10);
+    if (end == spec || *end != '/' || n == 0)
+        return 0;
+    spec = end + 1;
+    unsigned long secs = strtoul(spec, &end, 10);
+    if (*spec == '\0' || *end != '\0' || secs == 0)
+        return 0;
+    rate = (double) n / (secs * 1e6);
+    if (burst == 0)
+        burst = n;
+    return 1;
+}
+
+extern int limit_set_burst(const char *spec) {
+    char *end;
+    unsigned long n = strtoul(spec, &end, 10);
+    if (*spec == '\0' || *end != '\0' || n == 0)
+        return 0;
+    burst = n;
+    return 1;
+}
+
+extern int limit_set_key(const char *spec) {
+    if (!strcmp(spec, "app"))
+        by_category = 0;
+    else if (!strcmp(spec, "category"))
+        by_category = 1;
+    else
+        return 0;
+    return 1;
+}
+
+extern int limit_set_over(const char *spec) {
+    if (!strcmp(spec, "drop"))
+        over = LIMIT_DROP;
+    else if (!strcmp(spec, "summarize"))
+        over = LIMIT_SUMMARIZE;
+    else if (!strcmp(spec, "defer"))
+        over = LIMIT_DEFER;
+    else
+        return 0;
+    return 1;
+}
+
+extern int limit_active(void) {
+    return rate > 0;
+}
+
+extern void limit_callbacks(int (*release)(void *item),
+                            void (*summary)(const char *app,
+                                            const char *category,
+                                            unsigned long count)) {
+    release_cb = release;
+    summary_cb = summary;
+}
+
+static void refill(bucket *b) {
+    gint64 now = g_get_monotonic_time();
+    b->tokens += (now - b->last) * rate;
+    if (b->tokens > burst)
+        b->tokens = burst;
+    b->last = now;
+}
+
+static bucket *bucket_for(const NLNote *n) {
+    char *category = (by_category ? nl_get_hint_as_string(n, "category")
+                                  : NULL);
+    const char *app = (n->appname ? n->appname : "");
+    // The length keeps the app from running into its category.
+    char *key = g_strdup_printf("%zu:%s%s", strlen(app), app,
+                                (category ? category : ""));
+
+    bucket *b = g_hash_table_lookup(buckets, key);
+    if (b == NULL) {
+        b = calloc(1, sizeof(bucket));
+        b->app = g_strdup(app);
+        b->category = (category ? g_strdup(category) : NULL);
+        b->tokens = burst;
+        b->last = g_get_monotonic_time();
+        g_queue_init(&b->deferred);
+        g_hash_table_insert(buckets, key, b);
+    } else {
+        g_free(key);
+    }
+    free(category);
+    return b;
+}
+
+/* Spends a token on the bucket's summary, if it has both. */
+static void flush_summary(bucket *b) {
+    if (b->suppressed == 0 || b->tokens < 1)
+        return;
+    b->tokens -= 1;
+    b->summaries++;
+    if (summary_cb)
+        summary_cb(b->app, b->category, b->suppressed);
+    b->suppressed = 0;
+}
+
+static gboolean wake(gpointer data);
+
+static void arm(bucket *b) {
+    if (b->timer)
+        return;
+    if (g_queue_is_empty(&b->deferred) && b->suppressed == 0)
+        return;
+    gint64 wait = (gint64) ((1 - b->tokens) / rate) + 1;
+    b->timer = g_timeout_add(wait / 1000 + 1, wake, b);
+}
+
+static gboolean wake(gpointer data) {
+    bucket *b = data;
+    b->timer = 0;
+    refill(b);
+    while (b->tokens >= 1 && !g_queue_is_empty(&b->deferred)) {
+        void *item = g_queue_pop_head(&b->deferred);
+        if (release_cb(item))
+            b->tokens -= 1;
+    }
+    flush_summary(b);
+    arm(b);
+    return G_SOURCE_REMOVE;
+}
+
+extern int limit_take(const NLNote *n, void *item) {
+    gpointer key = GUINT_TO_POINTER(n->id);
+
+    if (!buckets) {
+        buckets = g_hash_table_new(g_str_hash, g_str_equal);
+        ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+
+    bucket *b = bucket_for(n);
+    refill(b);
+    flush_summary(b);
+
+    // Deferred notifications go first, even once there are tokens again.
+    if (b->tokens >= 1 && g_queue_is_empty(&b->deferred)) {
+        b->tokens -= 1;
+        g_hash_table_insert(ids, key, GINT_TO_POINTER(ID_HANDLED));
+        return LIMIT_PASS;
+    }
+
+    switch (over) {
+    case LIMIT_DEFER:
+        g_queue_push_tail(&b->deferred, item);
+        b->deferred_total++;
+        g_hash_table_insert(ids, key, GINT_TO_POINTER(ID_HANDLED));
+        break;
+    case LIMIT_SUMMARIZE:
+        b->suppressed++;
+        // fallthrough
+    default:
+        b->dropped++;
+        // An update shed after the notification was handled still
+        // leaves that notification to close.
+        if (!g_hash_table_contains(ids, key))
+            g_hash_table_insert(ids, key, GINT_TO_POINTER(ID_SHED));
+    }
+    arm(b);
+    return over;
+}
+
+/* Returns whether the close of the given id should be handled. */
+extern int limit_close(uint32_t id) {
+    gpointer key = GUINT_TO_POINTER(id);
+    int state;
+
+    if (!ids)
+        return 1;
+    state = GPOINTER_TO_INT(g_hash_table_lookup(ids, key));
+    g_hash_table_remove(ids, key);
+    return state != ID_SHED;
+}
+
+extern void limit_print_stats(void) {
+    GHashTableIter iter;
+    gpointer value;
+
+    if (!buckets)
+        return;
+    g_hash_table_iter_init(&iter, buckets);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        bucket *b = value;
+        if (b->dropped == 0 && b->deferred_total == 0)
+            continue;
+        fprintf(stderr, "notcat: rate limit for %s%s%s: %lu dropped, "
+                "%lu summaries, %lu deferred (%u waiting)\n",
+                b->app, (b->category ? " " : ""),
+                (b->category ? b->category : ""),
+                b->dropped, b->summaries, b->deferred_total,
+                g_queue_get_length(&b->deferred));
+    }
+}
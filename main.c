@@ -21,6 +21,10 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <signal.h>
+
+#include <glib.h>
+#include <glib-unix.h>
 
 #include "notlib/notlib.h"
 #include "notcat.h"
@@ -35,9 +39,17 @@ static char *on_notify_opt = "echo";
 static char *on_close_opt = NULL;
 static char *on_empty_opt = NULL;
 
+#define BATCH_MAX_DEFAULT 64
+
+static long batch_window_opt = 0;   /* milliseconds */
+static long batch_max_opt = 0;      /* 0 when not batching */
+
 static size_t default_fmt_opt_len = 1;
 static char *default_fmt_opt[] = {"%s"};
 
+static format fmt;      /* the format arguments */
+static format fmt_all;  /* those and every sink's format */
+
 static void usage(char *arg0, int code) {
     size_t alen = strlen(arg0);
     char spaces[alen + 1];
@@ -46,16 +58,44 @@ static void usage(char *arg0, int code) {
 
     fprintf(stderr, "Usage:\n"
             "  %s [-h | --help]\n"
-            "  %s [send <opts> | getcapabilities | getserverinfo | listen]\n"
-            "  %s [close <id> | invoke <id> [<key>]]\n"
+            "  %s [send <opts> | getcapabilities | getserverinfo | listen <opts>]\n"
+            "  %s [close <id> | invoke <id> [<key>] | wait <id>...]\n"
             "  %s [-se] [-t <timeout>] [--capabilities=<cap1>,<cap2>...] \\\n"
             "  %s [--on-notify=<cmd>] [--on-close=<cmd>] [--on-empty=<cmd>] \\\n"
+            "  %s [--jobs=<n>] [--flush=<policy>] [--zygote] [--worker] \\\n"
+            "  %s [--batch-window=<ms>] [--batch-max=<n>] \\\n"
+            "  %s [--rate-limit=<n>/<secs>] [--rate-burst=<n>] \\\n"
+            "  %s [--rate-by=app|category] [--rate-over=<policy>] \\\n"
+            "  %s [--sink=<sink>]... \\\n"
             "  %s [--] [format]...\n"
             "\n"
             "Options:\n"
             "  --on-notify=<cmd>  Command to run on each notification created\n\n"
             "  --on-close=<cmd>   Command to run on each notification closed\n\n"
             "  --on-empty=<cmd>   Command to run when no notifications remain\n\n"
+            "             A <cmd> of the form pipe:<handler> starts <handler> once\n"
+            "             and writes each event to its standard input\n\n"
+            "  --jobs=<n>         Run up to n commands at once without blocking\n\n"
+            "  --batch-window=<ms>\n"
+            "             Run a command once for the events of up to <ms>\n"
+            "             milliseconds, with the arguments for each in turn\n\n"
+            "  --batch-max=<n>    Run a command for at most n events at once\n\n"
+            "  --rate-limit=<n>/<secs>\n"
+            "             Handle at most n notifications per app every <secs>\n\n"
+            "  --rate-burst=<n>   Let an app send up to n notifications at once\n\n"
+            "  --rate-by=app|category\n"
+            "             Limit each app, or each app's category (default: app)\n\n"
+            "  --rate-over=drop|summarize|defer\n"
+            "             What to do with notifications over the limit\n"
+            "             (default: drop)\n\n"
+            "  --zygote           Spawn commands from a small helper process\n\n"
+            "  --worker           Handle events on a thread of their own\n\n"
+            "  --flush=event|interval:<ms>|size:<bytes>\n"
+            "             When to write echoed notifications (default: event)\n\n"
+            "  --sink=stdout|file:<path>|fifo:<path>|unix:<path>[,<opts>]\n"
+            "             Write echoed notifications there instead of to\n"
+            "             standard output; <opts> are queue=<n>,\n"
+            "             full=drop-oldest|drop-newest|block and format=<fmt>\n\n"
             "  --capabilities=<cap1>,<cap2>...\n"
             "             Additional capabilities to advertise\n\n"
             "  -t, --timeout=<timeout>\n"
@@ -67,7 +107,8 @@ static void usage(char *arg0, int code) {
             "\n"
             "For more detailed information and options for the 'send' subcommand,\n"
             "consult `man 1 notcat`.\n",
-           arg0, arg0, arg0, arg0, spaces, spaces);
+           arg0, arg0, arg0, arg0, spaces, spaces, spaces, spaces, spaces,
+           spaces, spaces);
 
     exit(code);
 }
@@ -130,6 +171,41 @@ static void notcat_getopt(int argc, char **argv) {
                 if (arg[8] == '\0' || *end != '\0' || to <= 0)
                     usage(arg0, 2);
                 nl_set_default_timeout((unsigned int)to);
+            } else if (!strncmp("jobs=", arg, 5)) {
+                char *end;
+                long int j = strtol(arg + 5, &end, 10);
+                if (arg[5] == '\0' || *end != '\0' || j <= 0 || j > 1024)
+                    usage(arg0, 2);
+                jobs_opt = (int)j;
+            } else if (!strncmp("batch-window=", arg, 13)) {
+                char *end;
+                batch_window_opt = strtol(arg + 13, &end, 10);
+                if (arg[13] == '\0' || *end != '\0' || batch_window_opt <= 0)
+                    usage(arg0, 2);
+            } else if (!strncmp("batch-max=", arg, 10)) {
+                char *end;
+                batch_max_opt = strtol(arg + 10, &end, 10);
+                if (arg[10] == '\0' || *end != '\0' || batch_max_opt <= 0
+                        || batch_max_opt > 1024)
+                    usage(arg0, 2);
+            } else if (!strncmp("rate-limit=", arg, 11)) {
+                if (!limit_set_rate(arg + 11))
+                    usage(arg0, 2);
+            } else if (!strncmp("rate-burst=", arg, 11)) {
+                if (!limit_set_burst(arg + 11))
+                    usage(arg0, 2);
+            } else if (!strncmp("rate-by=", arg, 8)) {
+                if (!limit_set_key(arg + 8))
+                    usage(arg0, 2);
+            } else if (!strncmp("rate-over=", arg, 10)) {
+                if (!limit_set_over(arg + 10))
+                    usage(arg0, 2);
+            } else if (!strncmp("flush=", arg, 6)) {
+                if (!output_set_policy(arg + 6))
+                    usage(arg0, 2);
+            } else if (!strncmp("sink=", arg, 5)) {
+                if (!sink_add(arg + 5))
+                    usage(arg0, 2);
             } else if (!strncmp("capabilities=", arg, 13)) {
                 char *ce, *cc = arg + 13;
                 for (ce = cc; *ce; ce++) {
@@ -140,6 +216,10 @@ static void notcat_getopt(int argc, char **argv) {
                     cc = ce + 1;
                 }
                 add_capability(cc);
+            } else if (!strcmp("zygote", arg)) {
+                zygote_opt = 1;
+            } else if (!strcmp("worker", arg)) {
+                worker_opt = 1;
             } else if (!strcmp("shell", arg)) {
                 shell_run_opt = 1;
             } else if (!strcmp("env", arg)) {
@@ -162,49 +242,480 @@ static void notcat_getopt(int argc, char **argv) {
         fmt_opt     = default_fmt_opt;
     }
 
-    fmt = parse_format(fmt_opt_len, fmt_opt);
+    fmt_all = sink_parse_formats(&fmt, fmt_opt_len, fmt_opt);
+
+    if (batch_window_opt > 0 && batch_max_opt == 0)
+        batch_max_opt = BATCH_MAX_DEFAULT;
 }
 
 static uint32_t rc = 0;
 
-void do_notify(const NLNote *n) {
-    current_event = "notify";
-    if (!strcmp(on_notify_opt, "echo") && !shell_run_opt) {
-        print_note(n);
-    } else if (*on_notify_opt) {
-        run_cmd(on_notify_opt, n);
+static void handle(const char *name, char *cmd, const note_copy *n) {
+    static buffer *scratch = NULL;
+    if (!scratch)
+        scratch = new_buffer(BUF_LEN);
+
+    fmt_ctx ctx;
+    if (n)
+        fmt_ctx_init_copy(&ctx, &fmt, n);
+    else
+        fmt_ctx_init(&ctx, &fmt, NULL);
+    ctx.event = name;
+    ctx.scratch = scratch;
+
+    if (!strcmp(cmd, "echo") && !shell_run_opt) {
+        print_note(&ctx);
+    } else if (!strncmp(cmd, "pipe:", 5)) {
+        coproc_send(coproc_for(cmd + 5), &ctx);
+    } else if (*cmd) {
+        run_cmd(cmd, &ctx);
     }
-    fflush(stdout);
+
+    fmt_ctx_free(&ctx);
 }
 
-void on_notify(const NLNote *n) {
-    ++rc;
-    do_notify(n);
+static void start_coprocs(void) {
+    char *opts[] = {on_notify_opt, on_close_opt, on_empty_opt};
+    size_t i;
+    for (i = 0; i < sizeof(opts) / sizeof(opts[0]); i++) {
+        if (opts[i] && !strncmp(opts[i], "pipe:", 5))
+            coproc_for(opts[i] + 5);
+    }
 }
 
-void on_close(const NLNote *n) {
-    current_event = "close";
-    --rc;
-    if (on_close_opt) {
-        if (!strcmp(on_close_opt, "echo") && !shell_run_opt) {
-            print_note(n);
-        } else if (*on_close_opt) {
-            run_cmd(on_close_opt, n);
+/*
+ * The event queue.  notlib's callbacks only queue events, which are handled
+ * once the main loop is idle; by then, anything which arrived while a
+ * handler ran has been queued too.  So a burst of updates to one
+ * notification collapses into one event: only the latest notify for each id
+ * is kept, in the place of the first, and a close drops any notify still
+ * waiting for the same id.  SIGUSR1 prints the queue's counters.
+ *
+ * Events wait in one FIFO band per urgency, and the highest band goes
+ * first, so a critical notification doesn't wait behind a backlog of chat
+ * messages.  Once STARVE_LIMIT events in a row have gone ahead of an older
+ * one, the oldest waiting event goes next.  An event never goes in a
+ * higher band than the event queued before it for the same id (its cap),
+ * so a close still follows its notify, and "empty" follows its close.
+ *
+ * With --rate-limit, a notify over its app's limit is dropped, along with
+ * its close, or waits in limit.c until the app has a token again.
+ */
+enum { BAND_LOW, BAND_NORMAL, BAND_CRITICAL, BANDS };
+
+#define STARVE_LIMIT 8
+
+typedef struct _event {
+    const char *name;   /* NULL once dropped */
+    char *cmd;
+    note_copy *note;    /* NULL for "empty" */
+    gint64 queued;      /* monotonic time */
+    int band, cap;
+    int deferred;       /* waiting for a rate limit token, not in a band */
+    struct _event *next;
+} event;
+
+static struct band {
+    event *head, **tail;
+} bands[BANDS];
+
+static GHashTable *queued_last = NULL;  /* id -> latest event, 0 for empty */
+static guint dispatch_source = 0;
+static int dispatch_timer = 0;      /* dispatch_source waits out a batch */
+static unsigned int passed_over = 0;
+
+static struct {
+    size_t depth, max_depth;
+    unsigned long queued, coalesced, dropped;
+    unsigned long batched, batches;
+    unsigned long ahead, shed;
+} stats;
+
+static int needs_job(const char *cmd) {
+    if (!strcmp(cmd, "echo"))
+        return shell_run_opt;
+    return (*cmd && strncmp(cmd, "pipe:", 5));
+}
+
+static int urgency_band(const NLNote *n) {
+    switch (n->urgency) {
+        case URG_LOW:  return BAND_LOW;
+        case URG_CRIT: return BAND_CRITICAL;
+        default:       return BAND_NORMAL;
+    }
+}
+
+static gpointer event_key(const event *e) {
+    return GUINT_TO_POINTER(e->note ? e->note->n.id : 0);
+}
+
+/*
+ * Returns the band to handle an event from next, or NULL if there are no
+ * events, freeing dropped ones.  *oldest is set to the band whose first
+ * event has waited longest.
+ */
+static struct band *next_band(struct band **oldest) {
+    struct band *b, *best = NULL;
+    *oldest = NULL;
+    for (b = bands + BANDS; b-- > bands; ) {
+        event *e;
+        while ((e = b->head) != NULL && e->name == NULL) {
+            b->head = e->next;
+            free(e);
+        }
+        if (e == NULL) {
+            b->tail = &b->head;
+            continue;
+        }
+        if (best == NULL)
+            best = b;
+        if (*oldest == NULL || e->queued < (*oldest)->head->queued)
+            *oldest = b;
+    }
+    if (best && passed_over >= STARVE_LIMIT)
+        return *oldest;
+    return best;
+}
+
+/* Takes the band's first event still to be handled; there must be one. */
+static event *take_event(struct band *b) {
+    event *e;
+    while ((e = b->head)->name == NULL) {
+        b->head = e->next;
+        free(e);
+    }
+    b->head = e->next;
+    if (b->head == NULL)
+        b->tail = &b->head;
+    if (g_hash_table_lookup(queued_last, event_key(e)) == e)
+        g_hash_table_remove(queued_last, event_key(e));
+    stats.depth--;
+    return e;
+}
+
+static void free_event(event *e) {
+    free_note_copy(e->note, &fmt);
+    free(e);
+}
+
+/*
+ * With --batch-window or --batch-max, a run of events for the same command
+ * goes to one invocation of it.  -e can only describe one note, and echo
+ * and pipe: handlers are cheap already, so only commands given their
+ * arguments are batched.
+ */
+static int batchable(event *e) {
+    return (batch_max_opt > 0 && e->note != NULL && !use_env_opt
+            && needs_job(e->cmd));
+}
+
+/* How many events, starting from e, could go in one batch. */
+static size_t batch_len(event *e) {
+    const char *name = e->name;
+    char *cmd = e->cmd;
+    size_t n = 0;
+    for (; e && n < (size_t) batch_max_opt; e = e->next) {
+        if (e->name == NULL)
+            continue;
+        if (e->name != name || e->cmd != cmd)
+            break;
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Handles a list of events, linked through 'next', for the same command:
+ * one event, or a batch.  With --worker, this runs on the handler thread,
+ * and the events are its own from here on.
+ */
+static void handle_events(void *item) {
+    event *e, *list = item;
+    size_t i, n = 0;
+
+    for (e = list; e; e = e->next)
+        n++;
+    if (n == 1) {
+        handle(list->name, list->cmd, list->note);
+        free_event(list);
+        return;
+    }
+
+    fmt_ctx ctx[n], *ctxs[n];
+    for (e = list, i = 0; e; e = e->next, i++) {
+        fmt_ctx_init_copy(&ctx[i], &fmt, e->note);
+        ctx[i].event = e->name;
+        ctxs[i] = &ctx[i];
+    }
+    run_batch(list->cmd, ctxs, n);
+
+    for (i = 0; i < n; i++)
+        fmt_ctx_free(&ctx[i]);
+    while ((e = list) != NULL) {
+        list = e->next;
+        free_event(e);
+    }
+}
+
+static void schedule_dispatch(void);
+
+static gboolean dispatch(gpointer data) {
+    guint self = dispatch_source;
+    int timer = dispatch_timer;
+    struct band *oldest, *b = next_band(&oldest);
+    event *e;
+
+    dispatch_source = 0;
+    dispatch_timer = 0;
+
+    // jobs_on_done(), or the handler thread making room, brings us back.
+    if (b == NULL)
+        return G_SOURCE_REMOVE;
+    if (worker_opt ? !worker_ready()
+                   : (needs_job(b->head->cmd) && !jobs_ready()))
+        return G_SOURCE_REMOVE;
+
+    e = b->head;
+    size_t i, n = 1;
+    if (batchable(e)) {
+        gint64 due = e->queued + batch_window_opt * 1000;
+        gint64 now = g_get_monotonic_time();
+        n = batch_len(e);
+        if (n < (size_t) batch_max_opt && now < due) {
+            dispatch_source = g_timeout_add((due - now + 999) / 1000,
+                    dispatch, NULL);
+            dispatch_timer = 1;
+            return G_SOURCE_REMOVE;
+        }
+        if (n > 1) {
+            stats.batched += n;
+            stats.batches++;
+        }
+    }
+
+    // Only count going ahead once the event is really taken, not while
+    // a batch window is still open.
+    if (b == oldest) {
+        passed_over = 0;
+    } else {
+        passed_over++;
+        stats.ahead++;
+    }
+
+    event *list = NULL, **tail = &list;
+    for (i = 0; i < n; i++) {
+        *tail = take_event(b);
+        tail = &(*tail)->next;
+    }
+    *tail = NULL;
+
+    if (worker_opt)
+        worker_push(list);
+    else
+        handle_events(list);
+
+    // One event (or batch) at a time, so that the main loop can take in
+    // new ones between them.
+    if (dispatch_source || next_band(&oldest) == NULL)
+        return G_SOURCE_REMOVE;
+    if (timer) {
+        schedule_dispatch();
+        return G_SOURCE_REMOVE;
+    }
+    dispatch_source = self;
+    return G_SOURCE_CONTINUE;
+}
+
+static void schedule_dispatch(void) {
+    // A new event may fill the batch being waited for.
+    if (dispatch_timer) {
+        g_source_remove(dispatch_source);
+        dispatch_source = 0;
+        dispatch_timer = 0;
+    }
+    if (!dispatch_source)
+        dispatch_source = g_idle_add(dispatch, NULL);
+}
+
+static event *new_event(const char *name, char *cmd, note_copy *note,
+                        int band, int cap) {
+    event *e = malloc(sizeof(event));
+    e->name = name;
+    e->cmd = cmd;
+    e->note = note;
+    e->queued = g_get_monotonic_time();
+    e->band = band;
+    e->cap = cap;
+    e->deferred = 0;
+    e->next = NULL;
+    return e;
+}
+
+static void append_event(event *e) {
+    e->next = NULL;
+    *bands[e->band].tail = e;
+    bands[e->band].tail = &e->next;
+    schedule_dispatch();
+}
+
+/*
+ * Queues an event in the given band, or a lower one to keep it behind the
+ * events already queued for the same id.  Returns the band used.
+ */
+static int enqueue(const char *name, char *cmd, const NLNote *n, int band) {
+    gpointer key = GUINT_TO_POINTER(n ? n->id : 0);
+    event *e = g_hash_table_lookup(queued_last, key);
+    int cap = BANDS - 1;
+
+    if (e)
+        cap = e->band;
+
+    if (e && !strcmp(name, "notify") && !strcmp(e->name, "notify")) {
+        free_note_copy(e->note, &fmt);
+        e->note = copy_note(&fmt, n);
+        stats.coalesced++;
+        if (band > e->cap)
+            band = e->cap;
+        if (band == e->band || e->deferred) {
+            e->band = band;
+            return band;
         }
+
+        // The new urgency moves the event, which keeps its place in line
+        // as far as starvation goes.
+        event *moved = malloc(sizeof(event));
+        *moved = *e;
+        moved->band = band;
+        e->name = NULL;
+        e->note = NULL;
+        append_event(moved);
+        g_hash_table_insert(queued_last, key, moved);
+        return band;
+    }
+    if (e && !strcmp(name, "close") && !strcmp(e->name, "notify")) {
+        g_hash_table_remove(queued_last, key);
+        cap = e->cap;
+        free_note_copy(e->note, &fmt);
+        e->note = NULL;
+        e->name = NULL;
+        stats.depth--;
+        stats.dropped++;
     }
-    if (rc == 0 && on_empty_opt) {
-        current_event = "empty";
-        if (!strcmp(on_empty_opt, "echo") && !shell_run_opt) {
-            print_note(NULL);
-        } else if (*on_empty_opt) {
-            run_cmd(on_empty_opt, NULL);
+    if (band > cap)
+        band = cap;
+    if (n && !strcmp(name, "close") && limit_active() && !limit_close(n->id))
+        return band;
+    if (cmd == NULL)
+        return band;
+
+    e = new_event(name, cmd, NULL, band, cap);
+    if (n && !strcmp(name, "notify") && limit_active()) {
+        switch (limit_take(n, e)) {
+        case LIMIT_PASS:
+            break;
+        case LIMIT_DEFER:
+            e->deferred = 1;
+            break;
+        default:
+            free(e);
+            stats.shed++;
+            return band;
         }
     }
-    fflush(stdout);
+    e->note = (n ? copy_note(&fmt, n) : NULL);
+    if (!e->deferred)
+        append_event(e);
+    g_hash_table_insert(queued_last, key, e);
+
+    stats.queued++;
+    if (++stats.depth > stats.max_depth)
+        stats.max_depth = stats.depth;
+    return band;
+}
+
+/* Called from limit.c when a deferred notify has a token. */
+static int release_event(void *item) {
+    event *e = item;
+    if (e->name == NULL) {
+        // Closed while it waited.
+        free(e);
+        return 0;
+    }
+    e->deferred = 0;
+    e->queued = g_get_monotonic_time();
+    append_event(e);
+    return 1;
+}
+
+/*
+ * Called from limit.c with the number of notifications an app sent over
+ * its limit, for --rate-over=summarize.  The summary is handled as a
+ * low-urgency notify of a note with id 0, which no real note has.
+ */
+static void summarize(const char *app, const char *category,
+                      unsigned long count) {
+    size_t len = strlen(app) + (category ? strlen(category) : 0) + 48;
+    char text[len];
+    NLNote n;
+
+    if (category)
+        snprintf(text, len, "%lu more from %s (%s)", count, app, category);
+    else
+        snprintf(text, len, "%lu more from %s", count, app);
+
+    memset(&n, 0, sizeof(NLNote));
+    n.appname = (char *) app;
+    n.summary = text;
+    n.body = "";
+    n.timeout = -1;
+    n.urgency = URG_LOW;
+
+    append_event(new_event("notify", on_notify_opt, copy_bare_note(&fmt, &n),
+                           BAND_LOW, BAND_LOW));
+    stats.queued++;
+    if (++stats.depth > stats.max_depth)
+        stats.max_depth = stats.depth;
+}
+
+static gboolean print_stats(gpointer data) {
+    fprintf(stderr, "notcat: queue depth %zu (max %zu); %lu queued, "
+            "%lu coalesced, %lu dropped by close, %lu batched into %lu runs, "
+            "%lu run ahead of older events, %lu over rate limits\n",
+            stats.depth, stats.max_depth,
+            stats.queued, stats.coalesced, stats.dropped,
+            stats.batched, stats.batches, stats.ahead, stats.shed);
+    limit_print_stats();
+    sink_print_stats();
+    return G_SOURCE_CONTINUE;
+}
+
+static void init_queue(void) {
+    int i;
+    for (i = 0; i < BANDS; i++)
+        bands[i].tail = &bands[i].head;
+    queued_last = g_hash_table_new(g_direct_hash, g_direct_equal);
+    limit_callbacks(release_event, summarize);
+    if (worker_opt)
+        worker_start(handle_events, schedule_dispatch);
+    else
+        jobs_on_done(schedule_dispatch);
+    g_unix_signal_add(SIGUSR1, print_stats, NULL);
+}
+
+void on_notify(const NLNote *n) {
+    ++rc;
+    enqueue("notify", on_notify_opt, n, urgency_band(n));
+}
+
+void on_close(const NLNote *n) {
+    --rc;
+    int band = enqueue("close", on_close_opt, n, urgency_band(n));
+    if (rc == 0)
+        enqueue("empty", on_empty_opt, NULL, band);
 }
 
 void on_replace(const NLNote *n) {
-    do_notify(n);
+    enqueue("notify", on_notify_opt, n, urgency_band(n));
 }
 
 int main(int argc, char **argv) {
@@ -225,19 +736,29 @@ int main(int argc, char **argv) {
             return get_server_information();
         }
         if (!strcmp(argv[1], "listen")) {
-            if (argc != 2) usage(argv[0], 2);
-            return listen_for_signals();
+            return listen_for_signals(argc - 2, argv + 2);
         }
         if (!strcmp(argv[1], "invoke")) {
             if (argc != 3 && argc != 4) usage(argv[0], 2);
             return invoke_action(argc - 2, argv + 2);
         }
+        if (!strcmp(argv[1], "wait")) {
+            if (argc < 3) usage(argv[0], 2);
+            return wait_notes(argc - 2, argv + 2);
+        }
     }
 
     notcat_getopt(argc, argv);
+    worker_init();
+    // Fork the zygote while we are still small.
+    if (zygote_opt)
+        zygote_start();
     if (use_env_opt) {
         add_capability("body");
-    } else fmt_capabilities();
+    } else fmt_capabilities(&fmt_all);
+    start_coprocs();
+    sink_start();
+    init_queue();
 
     NLNoteCallbacks cbs = {
         .notify = on_notify,
@@ -19,172 +19,22 @@
 
 #include <stdlib.h>
 #include <string.h>
-#include <sys/types.h>
 
-#include <stdio.h>
+#include "libnotcat.h"
 
-#include "notcat.h"
+/*
+ * Markup is stripped in a single left-to-right pass.  Open tags are kept on
+ * a small stack so that nesting can be validated as we go; any malformed or
+ * too-deeply-nested markup makes markup_body() fail, and the caller falls
+ * back to the raw text.
+ */
 
-#define EOB             0
-#define BODY_TEXT       1
-#define BODY_TAG        2
-#define BODY_TAG_CLOSE  3
+#define MAX_TAG_DEPTH 32
 
 typedef struct {
-	char type;
-	const char *str;
-	size_t len;
-} token;
-
-static ssize_t next_token(const char *in, token *t) {
-    size_t i = 0;
-    char c = in[i];
-    switch (c) {
-    case '\0':
-        t->type = EOB;
-        t->str = NULL;
-        t->len = 0;
-        return 0;
-    case '<':
-        i++;
-        if (in[i] == '/') {
-            i++;
-            t->type = BODY_TAG_CLOSE;
-            t->str = in + 2;
-        } else {
-            t->type = BODY_TAG;
-            t->str = in + 1;
-        }
-        break;
-    default:
-        t->type = BODY_TEXT;
-        t->str = in;
-    }
-    switch (t->type) {
-    case BODY_TAG:
-        for (; (c = in[i]); ++i) {
-            if (c == '>') {
-                t->len = i - 1;
-                return i + 1;
-            }
-        }
-        return -1;
-    case BODY_TAG_CLOSE:
-        for (; (c = in[i]); ++i) {
-            if (c == '>') {
-                t->len = i - 2;
-                return i + 1;
-            }
-        }
-        return -1;
-    default:
-        for (; (c = in[i]); ++i) {
-            if (c == '<') {
-                t->len = i;
-                return i;
-            }
-        }
-        t->len = i;
-        return i;
-    }
-}
-
-#define TOP_LEVEL_NODE  0
-#define TEXT_NODE       1
-#define TAG_NODE        2
-
-typedef struct node {
-    char type;
-    const char *str;
-    size_t strlen;
-    struct node *parent;
-    struct node *children[50];
-    size_t childlen;
-} node;
-
-static void free_tree(node *tree) {
-    for (int i = 0; i < tree->childlen; i++)
-        free_tree(tree->children[i]);
-    free(tree);
-}
-
-static node *parse(const char *in) {
-    token t;
-    size_t i = 0;
-    ssize_t adv;
-    node *tree = calloc(1, sizeof(node));
-    node *curr = tree;
-    while ((adv = next_token(in + i, &t)) >= 0) {
-        i += adv;
-        switch (t.type) {
-        case EOB:
-            goto after_loop;
-        case BODY_TEXT: {
-            /* FIXME: we don't check that childlen < 50 */
-            curr->children[curr->childlen] = calloc(1, sizeof(node));
-            node *child = curr->children[curr->childlen++];
-
-            child->parent = curr;
-            child->type = TEXT_NODE;
-            child->str = t.str;
-            child->strlen = t.len;
-            break;
-        }
-        case BODY_TAG: {
-            /* FIXME: we don't check that childlen < 50 */
-            curr->children[curr->childlen] = calloc(1, sizeof(node));
-            node *child = curr->children[curr->childlen++];
-
-            child->parent = curr;
-            child->type = TAG_NODE;
-            child->str = t.str;
-            child->strlen = t.len;
-
-            /* ignore tag attributes */
-            for (int i = 0; i < child->strlen; i++) {
-                if (child->str[i] == ' ') {
-                    child->strlen = i;
-                    break;
-                }
-            }
-
-            curr = child;
-            break;
-        }
-        case BODY_TAG_CLOSE:
-            if (t.len != curr->strlen || strncmp(t.str, curr->str, t.len)) {
-                /* closing the wrong tag. note we look at the whole tag contents here */
-                free_tree(tree);
-                return NULL;
-            }
-            if (curr->parent == NULL) {
-                /* closing tag without opening tag */
-                free_tree(tree);
-                return NULL;
-            }
-            curr = curr->parent;
-            break;
-        default:
-            /* code bug */
-            free_tree(tree);
-            return NULL;
-        }
-    }
-after_loop:
-    if (adv == -1) {
-        /* tokenizer sadness */
-        free_tree(tree);
-        return NULL;
-    }
-    if (curr != tree) {
-        /* unclosed tags. maybe we don't care about this? */
-        free_tree(tree);
-        return NULL;
-    }
-    return tree;
-}
-
-static int last_char_was_newline = 0;
+    const char *name;
+    size_t len;
+} tag;
 
 typedef struct {
     const char *code;
@@ -201,7 +51,7 @@ static ampcode ampcodes[] = {
     {NULL, 0, '\0'}
 };
 
-static int findampcode(const char *in, char *out) {
+static int findampcode(const char *in) {
     for (int i = 0; ampcodes[i].code != NULL; i++) {
         if (strncmp(ampcodes[i].code, in, ampcodes[i].len) == 0) {
             return i;
@@ -210,52 +60,78 @@ static int findampcode(const char *in, char *out) {
     return -1;
 }
 
-static size_t drain_node(node *n, char *out) {
-    size_t ret = 0;
-    switch (n->type) {
-    case TAG_NODE:
-        /* right now we just strip all tags */
-        for (int i = 0; i < n->childlen; i++)
-            ret += drain_node(n->children[i], out + ret);
-        break;
-    case TOP_LEVEL_NODE:
-        for (int i = 0; i < n->childlen; i++)
-            ret += drain_node(n->children[i], out + ret);
-        break;
-    case TEXT_NODE:
-        for (int i = 0; i < n->strlen; i++) {
-            if (n->str[i] == '\n') {
-                if (!last_char_was_newline)
-                    out[ret++] = ' ';
-                last_char_was_newline = 1;
-            } else if (n->str[i] == '&') {
-                last_char_was_newline = 0;
-                int aci = findampcode(n->str + i, out + ret);
-                if (aci >= 0) {
-                    out[ret++] = ampcodes[aci].out;
-                    i += ampcodes[aci].len - 1;
-                } else {
-                    out[ret++] = n->str[i];
-                }
+/* NOTE: we do not check the length of out. this is fine as long as we only strip markup */
+extern int markup_body(const char *in, char *out) {
+    tag stack[MAX_TAG_DEPTH];
+    size_t depth = 0, j = 0;
+    int last_char_was_newline = 0;
+    const char *c = in, *e;
+
+    while (*c) {
+        switch (*c) {
+        case '<': {
+            int closing = (c[1] == '/');
+            const char *name = c + 1 + closing;
+            for (e = name; *e && *e != '>'; e++)
+                ;
+            if (!*e)
+                return -1;  /* unterminated tag */
+
+            size_t len = e - name;
+            if (closing) {
+                /* note we compare the whole tag contents here */
+                if (depth == 0)
+                    return -1;  /* closing tag without opening tag */
+                if (stack[depth-1].len != len
+                        || strncmp(stack[depth-1].name, name, len))
+                    return -1;  /* closing the wrong tag */
+                depth--;
             } else {
-                last_char_was_newline = 0;
-                out[ret++] = n->str[i];
+                /* ignore tag attributes */
+                const char *sp = memchr(name, ' ', len);
+                if (sp != NULL)
+                    len = sp - name;
+                if (depth == MAX_TAG_DEPTH)
+                    return -1;
+                stack[depth].name = name;
+                stack[depth].len = len;
+                depth++;
             }
+            /* right now we just strip all tags */
+            c = e + 1;
+            break;
+        }
+        case '\n':
+            if (!last_char_was_newline)
+                out[j++] = ' ';
+            last_char_was_newline = 1;
+            c++;
+            break;
+        case '&': {
+            last_char_was_newline = 0;
+            int aci = findampcode(c);
+            if (aci >= 0) {
+                out[j++] = ampcodes[aci].out;
+                c += ampcodes[aci].len;
+            } else {
+                out[j++] = *c++;
+            }
+            break;
+        }
+        default:
+            /* copy the whole run of plain text at once */
+            e = scan(c, '<', '&', '\n');
+            memcpy(out + j, c, e - c);
+            j += e - c;
+            c = e;
+            last_char_was_newline = 0;
         }
     }
-    return ret;
-}
 
-/* NOTE: we do not check the length of out. this is fine as long as we only strip markup */
-extern int markup_body(const char *in, char *out) {
-    last_char_was_newline = 0;
-    node *tree = parse(in);
-    if (tree == NULL) {
-        return -1;   /* Fall back to raw text */
-    }
-    size_t i = drain_node(tree, out);
-    out[i] = '\0';
-    free_tree(tree);
+    if (depth != 0)
+        return -1;  /* unclosed tags. maybe we don't care about this? */
+
+    out[j] = '\0';
     return 0;
 }
 
@@ -17,88 +17,122 @@
  * along with notcat.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef NOTCAT_H
 #define NOTCAT_H
 
-#include "notlib/notlib.h"
+#include <sys/types.h>
 
-// buffer.c
+#include "libnotcat.h"
 
-#define BUF_LEN 512
+// run.c
 
-typedef struct _buffer buffer;
+extern char **fmt_string_opt;
+extern size_t fmt_string_opt_len;
+extern int shell_run_opt;
+extern int use_env_opt;
+extern int jobs_opt;
 
-extern buffer *new_buffer(size_t);
-extern char *dump_buffer(buffer *buf);
+extern void put_note_line(fmt_iov *v, fmt_ctx *ctx);
+extern void print_note(fmt_ctx *ctx);
+extern void put_note_fields(buffer *buf, fmt_ctx *ctx);
+extern void run_cmd(char *cmd, fmt_ctx *ctx);
+extern void run_batch(char *cmd, fmt_ctx **ctxs, size_t n);
+extern int spawn_cmd(pid_t *pid, char **argv, char **envp);
+extern int jobs_ready(void);
+extern void jobs_on_done(void (*cb)(void));
 
-extern void put_strn(buffer *, size_t, const char *);
-extern void put_str (buffer *, const char *);
-extern void put_char(buffer *, char);
+// coproc.c
 
-// parse.c
+typedef struct _coproc coproc;
 
-#define ITEM_TYPE_LITERAL       128  /* data held in item 'str' */
-#define ITEM_TYPE_CONDITIONAL   129  /* "if" held in item 'chr', "then" held in item 'subterm' */
+extern coproc *coproc_for(char *cmd);
+extern void coproc_send(coproc *c, fmt_ctx *ctx);
 
-typedef struct _fmt_item fmt_item;
+// zygote.c
 
-typedef struct _fmt_term {
-    size_t len;
-    fmt_item *items;
-} fmt_term;
+typedef void (*zygote_cb)(int status, int err, void *data);
 
-struct _fmt_item {
-    unsigned char type;
-    char *str;
-    char chr;
-    fmt_term subterm;
-};
+extern int zygote_opt;
 
-typedef struct _format {
-    size_t len;
-    fmt_term *terms;
-} format;
+extern void zygote_start(void);
+extern int zygote_spawn(char **argv, char **envp, zygote_cb cb, void *data);
+extern void zygote_wait(void *data);
 
-extern format fmt;
+// output.c
 
-extern format parse_format(size_t len, char **str);
+extern int output_set_policy(const char *spec);
+extern void output_write(struct iovec *iov, size_t len);
+extern void output_flush(void);
 
-// fmt.c
+// sink.c
 
-extern char *current_event;
+extern int sink_add(const char *spec);
+extern int sinks_active(void);
+extern format sink_parse_formats(format *main, size_t len, char **strs);
+extern void sink_start(void);
+extern void sink_print(fmt_ctx *ctx);
+extern void sink_print_stats(void);
 
-extern char *str_urgency(const enum NLUrgency urgency);
-extern void fmt_note_buf(buffer *buf, fmt_term *fmt, const NLNote *n);
-extern char *fmt_note(fmt_term *fmt, const NLNote *n);
+// worker.c
 
-// markup.c
+struct _GSource;
 
-extern int markup_body(const char *in, char *out);
+extern int worker_opt;
 
-// run.c
+extern unsigned int handler_attach(struct _GSource *s, int (*fn)(void *),
+                                   void *data);
+extern void handler_source_remove(unsigned int id);
+extern void worker_init(void);
+extern void worker_start(void (*handle)(void *item), void (*room)(void));
+extern int worker_ready(void);
+extern void worker_push(void *item);
 
-extern char **fmt_string_opt;
-extern size_t fmt_string_opt_len;
-extern int shell_run_opt;
-extern int use_env_opt;
+// limit.c
+
+#define LIMIT_PASS      0
+#define LIMIT_DROP      1
+#define LIMIT_SUMMARIZE 2
+#define LIMIT_DEFER     3
+
+extern int limit_set_rate(const char *spec);
+extern int limit_set_burst(const char *spec);
+extern int limit_set_key(const char *spec);
+extern int limit_set_over(const char *spec);
+extern int limit_active(void);
+extern void limit_callbacks(int (*release)(void *item),
+                            void (*summary)(const char *app,
+                                            const char *category,
+                                            unsigned long count));
+extern int limit_take(const NLNote *n, void *item);
+extern int limit_close(uint32_t id);
+extern void limit_print_stats(void);
+
+// wire.c
+
+typedef struct _wire wire;
 
-extern void print_note(const NLNote *n);
-extern void run_cmd(char *cmd, const NLNote *n);
+extern wire *wire_open(void);
+extern struct _GVariant *wire_call(wire *w, const char *name,
+                                   struct _GVariant *args);
+extern void wire_close(wire *w);
 
 // capabilities.c
 
 extern char **capabilities;
 
-extern void fmt_capabilities(void);
+extern void fmt_capabilities(const format *fmt);
 extern void add_capability(char *);
 
 // client.c
 
 extern int send_note(int argc, char **argv);
+extern int send_note_args(int argc, char **argv, uint32_t *id);
 extern int close_note(char *arg);
 extern int get_capabilities(void);
 extern int get_server_information(void);
-extern int listen_for_signals(void);
+extern int listen_for_signals(int argc, char **argv);
+extern int wait_notes(int argc, char **argv);
 extern int invoke_action(int argc, char **argv);
 
 #endif
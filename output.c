@@ -0,0 +1,168 @@
+/* Copyright 2025 Jack Conger */
+
+/*
+ * This file is part of notcat.
+ *
+ * notcat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notcat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with notcat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Output of the built-in echo, and when it is flushed.
+ *
+ *  --flush=event           write each event as soon as it is formatted
+ *  --flush=interval:<ms>   gather events, writing at most once per <ms>
+ *  --flush=size:<bytes>    gather events until <bytes> are pending or
+ *                          the main loop goes idle
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+#include "notcat.h"
+
+#define FLUSH_EVENT     0
+#define FLUSH_INTERVAL  1
+#define FLUSH_SIZE      2
+
+#define IOV_CHUNK 1024  /* Linux's UIO_MAXIOV */
+
+static int policy = FLUSH_EVENT;
+static unsigned long policy_arg = 0;
+
+static buffer *pending = NULL;
+static guint flush_source = 0;
+
+extern int output_set_policy(const char *spec) {
+    char *end;
+    if (!strcmp(spec, "event")) {
+        policy = FLUSH_EVENT;
+        return 1;
+    }
+    if (!strncmp(spec, "interval:", 9)) {
+        policy = FLUSH_INTERVAL;
+        spec += 9;
+    } else if (!strncmp(spec, "size:", 5)) {
+        policy = FLUSH_SIZE;
+        spec += 5;
+    } else {
+        return 0;
+    }
+    policy_arg = strtoul(spec, &end, 10);
+    return (*spec != '\0' && *end == '\0' && policy_arg > 0);
+}
+
+static void write_all(int fd, const char *s, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, s, len);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            return;
+        }
+        s += w;
+        len -= w;
+    }
+}
+
+static void write_iov(int fd, struct iovec *iov, size_t len) {
+    while (len > 0) {
+        ssize_t w = writev(fd, iov, (len < IOV_CHUNK ? len : IOV_CHUNK));
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("writev");
+            return;
+        }
+        while (len > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            len--;
+        }
+        if (len > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+}
+
+extern void output_flush(void) {
+    if (flush_source) {
+        handler_source_remove(flush_source);
+        flush_source = 0;
+    }
+    if (pending == NULL || buffer_len(pending) == 0)
+        return;
+
+    size_t len;
+    const char *s = buffer_view(pending, &len);
+    write_all(STDOUT_FILENO, s, len);
+    reset_buffer(pending);
+}
+
+static gboolean flush_cb(gpointer data) {
+    flush_source = 0;
+    output_flush();
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean terminate(gpointer data) {
+    output_flush();
+    exit(0);
+}
+
+extern void output_write(struct iovec *iov, size_t len) {
+    size_t i;
+
+    if (policy == FLUSH_EVENT) {
+        fflush(stdout);
+        write_iov(STDOUT_FILENO, iov, len);
+        return;
+    }
+
+    if (pending == NULL) {
+        pending = new_buffer(BUF_LEN);
+        /* don't lose what's pending when we're asked to stop */
+        handler_attach(g_unix_signal_source_new(SIGINT), terminate, NULL);
+        handler_attach(g_unix_signal_source_new(SIGTERM), terminate, NULL);
+    }
+    for (i = 0; i < len; i++)
+        put_strn(pending, iov[i].iov_len, iov[i].iov_base);
+
+    if (policy == FLUSH_SIZE) {
+        if (buffer_len(pending) >= policy_arg)
+            output_flush();
+        else if (!flush_source) {
+            /* below dispatch()'s idle, so a burst drains before we write */
+            GSource *s = g_idle_source_new();
+            g_source_set_priority(s, G_PRIORITY_LOW);
+            flush_source = handler_attach(s, flush_cb, NULL);
+        }
+    } else if (!flush_source) {
+        flush_source = handler_attach(g_timeout_source_new(policy_arg),
+                                      flush_cb, NULL);
+    }
+}
+
+/* vim: set ft=c tabstop=4 softtabstop=4 shiftwidth=4 expandtab textwidth=0: */
@@ -21,9 +21,9 @@
 #include <string.h>
 #include <stdio.h>
 
-#include "notcat.h"
+#include "libnotcat.h"
 
-#define TERM_INITIAL_CAP 1
+#define TERM_INITIAL_CAP 4
 
 #define TS_NORMAL   0
 #define TS_PCT      1
@@ -31,56 +31,127 @@
 #define TS_KV       3
 #define TS_COND     4
 
-static fmt_item make_literal(size_t len, char *s, char c) {
-    fmt_item f;
-    f.type = ITEM_TYPE_LITERAL;
-    f.str = malloc(len);
-    snprintf(f.str, len, s, c);
-    return f;
+/*
+ * Format strings are compiled into a flat array of ops per term.  A
+ * conditional is a single OP_COND op followed by the ops of its body, and
+ * 'len' on the OP_COND is how many ops to skip when the condition is false.
+ * Adjacent literals are merged, but never across the end of a conditional
+ * body, which is tracked by 'barrier'.
+ */
+
+typedef struct {
+    format *fmt;
+    fmt_term term;
+    size_t cap;
+    size_t barrier;
+} compiler;
+
+static fmt_op *push_op(compiler *cc, unsigned char type) {
+    if (cc->term.len == cc->cap) {
+        cc->cap *= 2;
+        cc->term.ops = realloc(cc->term.ops, sizeof(fmt_op) * cc->cap);
+    }
+    fmt_op *op = &cc->term.ops[cc->term.len++];
+    op->type = type;
+    op->chr = 0;
+    op->len = 0;
+    op->str = NULL;
+    op->slot = 0;
+    return op;
 }
 
-#define PUSH_ITEM(expr) \
-    if (term.len == cap) { \
-        cap *= 2; \
-        term.items = realloc(term.items, sizeof(fmt_item) * cap); \
-    } \
-    term.items[term.len++] = (expr);
+static void push_literal(compiler *cc, const char *s, size_t len) {
+    if (len == 0)
+        return;
 
-static fmt_term parse_term(char *str) {
-    fmt_term term;
-    fmt_item cur;
+    if (cc->term.len > cc->barrier
+            && cc->term.ops[cc->term.len - 1].type == OP_LITERAL) {
+        fmt_op *prev = &cc->term.ops[cc->term.len - 1];
+        prev->str = realloc(prev->str, prev->len + len + 1);
+        memcpy(prev->str + prev->len, s, len);
+        prev->len += len;
+        prev->str[prev->len] = '\0';
+        return;
+    }
+
+    fmt_op *op = push_op(cc, OP_LITERAL);
+    op->str = malloc(len + 1);
+    memcpy(op->str, s, len);
+    op->str[len] = '\0';
+    op->len = len;
+}
+
+static void push_literalf(compiler *cc, const char *f, char c) {
+    char tmp[8];
+    int len = snprintf(tmp, sizeof(tmp), f, c);
+    push_literal(cc, tmp, len);
+}
+
+/*
+ * Hint names and action keys are interned per format, so each hint has a
+ * fixed slot and -e knows which ones to export.
+ */
+static size_t intern(char ***tab, size_t *tab_len, const char *name, size_t len) {
+    size_t i;
+    for (i = 0; i < *tab_len; i++) {
+        if (strlen((*tab)[i]) == len && !strncmp((*tab)[i], name, len))
+            return i;
+    }
+    *tab = realloc(*tab, sizeof(char *) * (*tab_len + 1));
+    (*tab)[*tab_len] = malloc(len + 1);
+    memcpy((*tab)[*tab_len], name, len);
+    (*tab)[*tab_len][len] = '\0';
+    return (*tab_len)++;
+}
+
+static size_t hint_slot(format *fmt, const char *name, size_t len) {
+    return intern(&fmt->hints, &fmt->hints_len, name, len);
+}
+
+static void push_field(compiler *cc, char type) {
+    fmt_op *op = push_op(cc, type);
+    if (type == 'c') {
+        op->slot = HINT_SLOT_CATEGORY;
+        op->str = cc->fmt->hints[op->slot];
+    }
+}
+
+static void push_kv(compiler *cc, char type, const char *key, size_t len) {
+    fmt_op *op = push_op(cc, type);
+    if (type == 'h') {
+        op->slot = hint_slot(cc->fmt, key, len);
+        op->str = cc->fmt->hints[op->slot];
+    } else {
+        op->slot = intern(&cc->fmt->actions, &cc->fmt->actions_len, key, len);
+        op->str = cc->fmt->actions[op->slot];
+    }
+    op->len = len;
+}
+
+static void compile_term(compiler *cc, const char *str) {
     const char *c, *c2;
     char state = TS_NORMAL;
-    size_t cap = TERM_INITIAL_CAP;
-    term.len = 0;
-    term.items = malloc(sizeof(fmt_item) * cap);
+    char cur_type = 0, cur_chr = 0;
 
     for (c = str; *c; c++) {
         switch (state) {
         case TS_KV:
-            /* cur.type already set in TS_PCTPAREN code */
+            /* cur_type already set in TS_PCTPAREN code */
             for (c2 = c; *c2 && *c2 != ')'; c2++)
                 ;
             if (!*c2) {
                 /* oops! literal: `%(x:...` */
-                PUSH_ITEM(make_literal(5, "%%(%c:", cur.type));
-                cur.type = ITEM_TYPE_LITERAL;
-                cur.str = malloc(c2 - c + 1);
-                strncpy(cur.str, c, c2 - c);
-                cur.str[c2 - c] = '\0';
-                PUSH_ITEM(cur);
+                push_literalf(cc, "%%(%c:", cur_type);
+                push_literal(cc, c, c2 - c);
                 c = c2 - 1;
             } else {
-                cur.str = malloc(c2 - c + 1);
-                strncpy(cur.str, c, c2 - c);
-                cur.str[c2 - c] = '\0';
-                PUSH_ITEM(cur);
+                push_kv(cc, cur_type, c, c2 - c);
                 c = c2;
             }
             state = TS_NORMAL;
             break;
         case TS_COND: {
-            /* cur.type already set in TS_PCTPAREN code */
+            /* cur_chr already set in TS_PCTPAREN code */
             size_t paren_depth = 1;
             for (c2 = c; *c2; c2++) {
                 switch (*c2) {
@@ -91,12 +162,8 @@ static fmt_term parse_term(char *str) {
             }
             if (!*c2) {
                 /* oops! literal: `%(?x:...` */
-                PUSH_ITEM(make_literal(6, "%%(?%c:", cur.chr));
-                cur.type = ITEM_TYPE_LITERAL;
-                cur.str = malloc(c2 - c + 1);
-                strncpy(cur.str, c, c2 - c);
-                cur.str[c2 - c] = '\0';
-                PUSH_ITEM(cur);
+                push_literalf(cc, "%%(?%c:", cur_chr);
+                push_literal(cc, c, c2 - c);
                 state = TS_NORMAL;
                 c = c2 - 1;
                 break;
@@ -104,8 +171,18 @@ static fmt_term parse_term(char *str) {
                 char tmp[c2 - c + 1];
                 strncpy(tmp, c, c2 - c);
                 tmp[c2 - c] = '\0';
-                cur.subterm = parse_term(tmp);
-                PUSH_ITEM(cur);
+
+                size_t at = cc->term.len;
+                fmt_op *op = push_op(cc, OP_COND);
+                op->chr = cur_chr;
+                if (cur_chr == 'c') {
+                    op->slot = HINT_SLOT_CATEGORY;
+                    op->str = cc->fmt->hints[op->slot];
+                }
+                compile_term(cc, tmp);
+                /* push_op may have moved the array */
+                cc->term.ops[at].len = cc->term.len - at - 1;
+                cc->barrier = cc->term.len;
                 c = c2;
             }
             state = TS_NORMAL;
@@ -114,10 +191,10 @@ static fmt_term parse_term(char *str) {
         case TS_PCTPAREN:
             switch (*c) {
             case 'A': case 'h':
-                cur.type = *c;
+                cur_type = *c;
                 if (c[1] != ':') {
                     /* oops! literal: `%(xx` */
-                    PUSH_ITEM(make_literal(4, "%%(%c", *c));
+                    push_literalf(cc, "%%(%c", *c);
                     state = TS_NORMAL;
                     break;
                 }
@@ -125,59 +202,52 @@ static fmt_term parse_term(char *str) {
                 state = TS_KV;
                 break;
             case '?':
-                cur.type = ITEM_TYPE_CONDITIONAL;
-                if (!strchr("asbBtcuAh", c[1]) || c[2] != ':') {
-                    PUSH_ITEM(make_literal(4, "%%(?", 0));
+                if (!strchr("asbBtcuAhrk", c[1]) || c[2] != ':') {
+                    push_literal(cc, "%(?", 3);
                     state = TS_NORMAL;
                     break;
                 }
-                cur.chr = c[1];
+                cur_chr = c[1];
                 c += 2;
                 state = TS_COND;
                 break;
             case 'i': case 'a': case 's': case 'b': case 'B':
-            case 't': case 'u': case 'c': case 'n':
-                cur.type = *c;
+            case 't': case 'u': case 'c': case 'n': case 'r': case 'k':
                 switch (c[1]) {
                 case ')':
+                    push_field(cc, *c);
                     c++;
                     state = TS_NORMAL;
-                    cur.str = NULL;
-                    PUSH_ITEM(cur);
                     break;
                 default:
                     /* oops! literal: `%(x` */
-                    PUSH_ITEM(make_literal(4, "%%(%c", *c));
+                    push_literalf(cc, "%%(%c", *c);
                     state = TS_NORMAL;
                 }
                 break;
             default:
                 /* oops! literal: `%(x` */
-                PUSH_ITEM(make_literal(4, "%%(%c", *c));
+                push_literalf(cc, "%%(%c", *c);
                 state = TS_NORMAL;
             }
             break;
         case TS_PCT:
             switch (*c) {
             case 'i': case 'a': case 's': case 'b': case 'B':
-            case 't': case 'u': case 'c': case 'n':
-                cur.type = *c;
-                cur.str  = NULL;
-                PUSH_ITEM(cur);
+            case 't': case 'u': case 'c': case 'n': case 'r': case 'k':
+                push_field(cc, *c);
                 state = TS_NORMAL;
                 break;
             case '(':
                 state = TS_PCTPAREN;
                 break;
             case '%':
-                cur.type = ITEM_TYPE_LITERAL;
-                cur.str = "%";
-                PUSH_ITEM(cur);
+                push_literal(cc, "%", 1);
                 state = TS_NORMAL;
                 break;
             default:
                 /* oops! literal: `%x` */
-                PUSH_ITEM(make_literal(3, "%%%c", *c));
+                push_literalf(cc, "%%%c", *c);
                 state = TS_NORMAL;
             }
             break;
@@ -186,13 +256,9 @@ static fmt_term parse_term(char *str) {
                 state = TS_PCT;
                 break;
             }
-            cur.type = ITEM_TYPE_LITERAL;
             for (c2 = c; *c2 && *c2 != '%'; c2++)
                 ;
-            cur.str = malloc(c2 - c + 1);
-            strncpy(cur.str, c, c2 - c);
-            cur.str[c2 - c] = '\0';
-            PUSH_ITEM(cur);
+            push_literal(cc, c, c2 - c);
             if (*c2 == '%') {
                 state = TS_PCT;
                 c = c2;
@@ -208,23 +274,29 @@ static fmt_term parse_term(char *str) {
     // Clean up leftover state, if we fell off the end of a term
     switch (state) {
     case TS_PCT:
-        cur.type = ITEM_TYPE_LITERAL;
-        cur.str = "%";
-        PUSH_ITEM(cur);
+        push_literal(cc, "%", 1);
         break;
     case TS_PCTPAREN:
-        cur.type = ITEM_TYPE_LITERAL;
-        cur.str = "%(";
-        PUSH_ITEM(cur);
+        push_literal(cc, "%(", 2);
         break;
     case TS_KV:
-        PUSH_ITEM(make_literal(5, "%%(%c:", cur.type));
+        push_literalf(cc, "%%(%c:", cur_type);
         break;
     case TS_COND:
-        PUSH_ITEM(make_literal(6, "%%(?%c:", cur.chr));
+        push_literalf(cc, "%%(?%c:", cur_chr);
     }
+}
+
+static fmt_term parse_term(format *fmt, char *str) {
+    compiler cc;
+    cc.fmt = fmt;
+    cc.cap = TERM_INITIAL_CAP;
+    cc.barrier = 0;
+    cc.term.len = 0;
+    cc.term.ops = malloc(sizeof(fmt_op) * cc.cap);
 
-    return term;
+    compile_term(&cc, str);
+    return cc.term;
 }
 
 extern format parse_format(size_t len, char **str) {
@@ -233,8 +305,34 @@ extern format parse_format(size_t len, char **str) {
 
     fmt.len = len;
     fmt.terms = malloc(sizeof(fmt_term) * len);
+    fmt.hints_len = 0;
+    fmt.hints = NULL;
+    fmt.actions_len = 0;
+    fmt.actions = NULL;
+    hint_slot(&fmt, "category", 8);  /* HINT_SLOT_CATEGORY */
     for (i = 0; i < len; i++)
-        fmt.terms[i] = parse_term(str[i]);
+        fmt.terms[i] = parse_term(&fmt, str[i]);
 
     return fmt;
 }
+
+extern void free_format(format *fmt) {
+    size_t i, j;
+    for (i = 0; i < fmt->len; i++) {
+        for (j = 0; j < fmt->terms[i].len; j++) {
+            if (fmt->terms[i].ops[j].type == OP_LITERAL)
+                free(fmt->terms[i].ops[j].str);
+        }
+        free(fmt->terms[i].ops);
+    }
+    for (i = 0; i < fmt->hints_len; i++)
+        free(fmt->hints[i]);
+    for (i = 0; i < fmt->actions_len; i++)
+        free(fmt->actions[i]);
+    free(fmt->terms);
+    free(fmt->hints);
+    free(fmt->actions);
+    fmt->len = fmt->hints_len = fmt->actions_len = 0;
+    fmt->terms = NULL;
+    fmt->hints = fmt->actions = NULL;
+}
@@ -17,116 +17,576 @@
  * along with notcat.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-// Used for setenv() (for now) and posix_spawnp()
-#define _POSIX_C_SOURCE 200809L
+// Used for posix_spawn() and POSIX_SPAWN_USEVFORK
+#define _GNU_SOURCE
 
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <errno.h>
 #include <string.h>
 #include <spawn.h>
+#include <signal.h>
+#include <stdint.h>
+
+#include <glib.h>
 
 #include "notlib/notlib.h"
 #include "notcat.h"
 
 int shell_run_opt = 0;
 int use_env_opt   = 0;
+int jobs_opt      = 0;
+
+/* Appends the format's terms, separated by spaces, and a newline. */
+extern void put_note_line(fmt_iov *v, fmt_ctx *ctx) {
+    size_t i;
+    for (i = 0; i < ctx->fmt->len; i++) {
+        fmt_note_iov(v, &ctx->fmt->terms[i], ctx);
+        if (i < ctx->fmt->len - 1)
+            fmt_iov_push(v, " ", 1);
+    }
+    fmt_iov_push(v, "\n", 1);
+}
+
+/*
+ * The built-in echo.  Rather than copying the note into a buffer and then
+ * into stdio, the output is gathered straight from the note and the format
+ * and handed to output.c, or to sink.c with --sink, as a list of iovecs.
+ */
+
+extern void print_note(fmt_ctx *ctx) {
+    static fmt_iov v;
+    static int v_init = 0;
+
+    if (sinks_active()) {
+        sink_print(ctx);
+        return;
+    }
+
+    if (!v_init) {
+        fmt_iov_init(&v);
+        v_init = 1;
+    }
+    fmt_iov_reset(&v, ctx->fmt);
+    put_note_line(&v, ctx);
+    output_write(v.iov, v.len);
+}
+
+/* Hint names and action keys may contain anything; variable names may not. */
+static void put_name(buffer *buf, const char *prefix, const char *name) {
+    put_str(buf, prefix);
+    for (; *name; name++) {
+        char c = *name;
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')))
+            c = '_';
+        put_char(buf, c);
+    }
+    put_char(buf, '=');
+}
 
-extern void print_note(const NLNote *n) {
-    buffer *buf = new_buffer(BUF_LEN);
+static void put_field(buffer *buf, const char *key, const char *val) {
+    put_str(buf, key);
+    put_char(buf, '=');
+    if (val) put_str(buf, val);
+    put_char(buf, '\0');
+}
+
+/*
+ * Writes the fields -e exports for an event as NUL-terminated KEY=VALUE
+ * strings.  notlib can only look hints and actions up by name, so the ones
+ * exported are those the format refers to.
+ */
+extern void put_note_fields(buffer *buf, fmt_ctx *ctx) {
+    const NLNote *n = ctx->n;
+    put_field(buf, "NOTCAT_EVENT", ctx->event);
+    if (n == NULL)
+        return;
+
+    put_str(buf, "NOTE_ID=");
+    put_uint(buf, n->id);
+    put_char(buf, '\0');
+    put_field(buf, "NOTE_APP_NAME", n->appname);
+    put_field(buf, "NOTE_SUMMARY", n->summary);
+    put_field(buf, "NOTE_BODY", n->body);
+    put_field(buf, "NOTE_URGENCY", str_urgency(n->urgency));
+    put_str(buf, "NOTE_TIMEOUT=");
+    put_int(buf, n->timeout);
+    put_char(buf, '\0');
+
+    const char *h = fmt_ctx_hint(ctx, HINT_SLOT_CATEGORY);
+    if (h != NULL)
+        put_field(buf, "NOTE_CATEGORY", h);
 
     size_t i;
-    for (i = 0; i < fmt.len; i++) {
-        fmt_note_buf(buf, &fmt.terms[i], n);
-        if (i < fmt.len - 1)
-            put_char(buf, ' ');
+    for (i = HINT_SLOT_CATEGORY + 1; i < ctx->fmt->hints_len; i++) {
+        if ((h = fmt_ctx_hint(ctx, i)) == NULL)
+            continue;
+        put_name(buf, "NOTE_HINT_", ctx->fmt->hints[i]);
+        put_str(buf, h);
+        put_char(buf, '\0');
     }
+    for (i = 0; i < ctx->fmt->actions_len; i++) {
+        if ((h = fmt_ctx_action(ctx, i)) == NULL)
+            continue;
+        put_name(buf, "NOTE_ACTION_", ctx->fmt->actions[i]);
+        put_str(buf, h);
+        put_char(buf, '\0');
+    }
+}
+
+/*
+ * Handler jobs.  With --jobs=N (jobs_opt > 0), up to N handlers run at once
+ * and are reaped through the GLib main loop; events beyond that wait in a
+ * FIFO.  A job never starts while another job for the same notification id
+ * is running, so events for one notification still run in order; a batch
+ * counts as running for each of the ids in it.
+ */
+
+typedef struct _job {
+    uint32_t id;        /* 0 for events without a note, e.g. "empty" */
+    uint32_t *ids;      /* every id a batch is for; &id otherwise */
+    size_t ids_len;
+    const char *event;
+    char *args;         /* formatted arguments, if this job owns them */
+    char **envp;        /* NULL to use environ */
+    char *env;          /* fields envp points into, if this job owns them */
+    GPid pid;
+    struct _job *next;
+    char *argv[];       /* allocated along with the job */
+} job;
+
+static job *pending = NULL;
+static job **pending_tail = &pending;
 
-    put_char(buf, '\n');
-    char *fin = dump_buffer(buf);
-    fputs(fin, stdout);
-    free(fin);
+static job *running = NULL;
+static int running_len = 0;
+
+static void free_job(job *j) {
+    if (j->ids != &j->id)
+        free(j->ids);
+    free(j->args);
+    if (j->env) {
+        free(j->env);
+        free(j->envp);
+    }
+    free(j);
 }
 
-extern void run_cmd(char *cmd, const NLNote *n) {
-    size_t prefix_len = (shell_run_opt ? 4 : 1);
-    size_t fmt_len    = (use_env_opt   ? 0 : fmt.len);
+/*
+ * The environment -e handlers inherit: ours, less any variables we set per
+ * event, so that nothing from an earlier notification can leak into a
+ * later handler.  The strings themselves are environ's, which we never
+ * modify.
+ */
+static char **base_env = NULL;
+static size_t base_env_len = 0;
 
-    char **cmd_argv = malloc(sizeof(char *) * (1 + prefix_len + fmt_len));
+static void init_base_env(void) {
+    extern char **environ;
+    size_t len;
+    for (len = 0; environ[len]; len++)
+        ;
 
-    static char *sh = NULL;
-    if (!sh && !(sh = getenv("SHELL")))
-        sh = "/bin/sh";
+    base_env = malloc(sizeof(char *) * len);
+    for (len = 0; environ[len]; len++) {
+        if (!strncmp(environ[len], "NOTE_", 5) ||
+                !strncmp(environ[len], "NOTCAT_EVENT=", 13))
+            continue;
+        base_env[base_env_len++] = environ[len];
+    }
+}
 
-    if (shell_run_opt) {
-        cmd_argv[0] = sh;
-        cmd_argv[1] = "-c";
-        cmd_argv[2] = cmd;
-        cmd_argv[3] = "notcat";
-    } else {
-        cmd_argv[0] = cmd;
+static size_t count_fields(const char *fields, size_t len) {
+    size_t i, n = 0;
+    for (i = 0; i < len; i++)
+        n += (fields[i] == '\0');
+    return n;
+}
+
+/* Fills envp with base_env and then each of the NUL-terminated fields. */
+static void fill_env(char **envp, char *fields, size_t len) {
+    char *p;
+    memcpy(envp, base_env, sizeof(char *) * base_env_len);
+    envp += base_env_len;
+    for (p = fields; p < fields + len; p += strlen(p) + 1)
+        *envp++ = p;
+    *envp = NULL;
+}
+
+/*
+ * Sets up j's environment for the event.  The fields are written to a
+ * reused buffer; a job which runs right away points straight into it, and
+ * queued jobs, which may outlive the event, get their own copy.
+ */
+static void build_env(job *j, fmt_ctx *ctx) {
+    static buffer *buf = NULL;
+    static char **envp = NULL;
+    static size_t envp_cap = 0;
+
+    if (!buf) {
+        buf = new_buffer(BUF_LEN);
+        init_base_env();
     }
+    reset_buffer(buf);
+    put_note_fields(buf, ctx);
 
-    size_t i;
-    for (i = 0; i < fmt_len; i++) {
-        cmd_argv[i+prefix_len] = fmt_note(&fmt.terms[i], n);
+    size_t len;
+    char *fields = (char *)buffer_view(buf, &len);
+    size_t envp_len = base_env_len + count_fields(fields, len) + 1;
+
+    if (jobs_opt > 0) {
+        j->env = malloc(len);
+        memcpy(j->env, fields, len);
+        j->envp = malloc(sizeof(char *) * envp_len);
+        fill_env(j->envp, j->env, len);
+        return;
+    }
+
+    if (envp_len > envp_cap) {
+        envp_cap = envp_len * 2;
+        envp = realloc(envp, sizeof(char *) * envp_cap);
     }
-    cmd_argv[fmt_len + prefix_len] = NULL;
+    fill_env(envp, fields, len);
+    j->envp = envp;
+}
 
-    // FIXME: Build a new cmd_env instead of munging the local environment
-    if (use_env_opt) {
-        setenv("NOTCAT_EVENT", current_event, 1);
+/*
+ * Handlers are looked up in PATH once, rather than by posix_spawnp() on
+ * every event.  If a cached path stops working, it is looked up again.
+ */
+typedef struct _resolved {
+    char *name;
+    char *path;     /* NULL if not found */
+    struct _resolved *next;
+} resolved;
 
-        if (n != NULL) {
-            char str[12];  // big enough to store a 32-bit int
+static resolved *resolved_cmds = NULL;
 
-            setenv("NOTE_APP_NAME", n->appname, 1);
-            setenv("NOTE_SUMMARY", n->summary, 1);
-            setenv("NOTE_BODY", n->body, 1);
-            setenv("NOTE_URGENCY", str_urgency(n->urgency), 1);
+static char *search_path(const char *name) {
+    if (strchr(name, '/'))
+        return strdup(name);
 
-            snprintf(str, 12, "%u", n->id);
-            setenv("NOTE_ID", str, 1);
+    const char *dir = getenv("PATH");
+    if (dir == NULL)
+        dir = "/bin:/usr/bin";
 
-            snprintf(str, 12, "%d", n->timeout);
-            setenv("NOTE_TIMEOUT", str, 1);
+    size_t name_len = strlen(name);
+    for (;;) {
+        const char *end = strchr(dir, ':');
+        size_t dir_len = (end ? (size_t)(end - dir) : strlen(dir));
 
-            char *h = nl_get_hint_as_string(n, "category");
-            if (h != NULL) {
-                setenv("NOTE_CATEGORY", h, 1);
-                free(h);
-            }
+        // An empty PATH entry means the current directory.
+        char *path = malloc(dir_len + name_len + 3);
+        if (dir_len == 0)
+            path[dir_len++] = '.';
+        else
+            memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + 1, name, name_len + 1);
 
-            // TODO: Figure out a sensible way to do hints and actions
+        // Skip directories, as execvp() does.
+        struct stat st;
+        if (access(path, X_OK) == 0 && stat(path, &st) == 0
+                && S_ISREG(st.st_mode))
+            return path;
+        free(path);
+
+        if (end == NULL)
+            return NULL;
+        dir = end + 1;
+    }
+}
+
+static const char *resolve_cmd(const char *name, int refresh) {
+    resolved *r;
+    for (r = resolved_cmds; r; r = r->next) {
+        if (!strcmp(r->name, name)) {
+            if (!refresh)
+                return r->path;
+            break;
         }
     }
+    if (r == NULL) {
+        r = malloc(sizeof(resolved));
+        r->name = strdup(name);
+        r->next = resolved_cmds;
+        resolved_cmds = r;
+    } else {
+        free(r->path);
+    }
+    r->path = search_path(name);
+    return r->path;
+}
 
-    int err;
-    pid_t cpid;
+/*
+ * Spawning shares the parent's memory (vfork) rather than copying our page
+ * tables.  Coprocess handlers make us ignore SIGPIPE, which would otherwise
+ * be inherited.
+ */
+static posix_spawnattr_t *spawn_attr(void) {
+    static posix_spawnattr_t attr;
+    static int attr_init = 0;
+    if (!attr_init) {
+        sigset_t sigs;
+        short flags = POSIX_SPAWN_SETSIGDEF;
+#ifdef POSIX_SPAWN_USEVFORK
+        flags |= POSIX_SPAWN_USEVFORK;
+#endif
+        sigemptyset(&sigs);
+        sigaddset(&sigs, SIGPIPE);
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setsigdefault(&attr, &sigs);
+        posix_spawnattr_setflags(&attr, flags);
+        attr_init = 1;
+    }
+    return &attr;
+}
+
+/*
+ * Spawns argv[0], found in PATH, with the given environment (NULL for
+ * environ).  Returns 0 or an errno value.
+ */
+extern int spawn_cmd(pid_t *pid, char **argv, char **envp) {
+    int err, retried = 0;
     extern char **environ;
-    if ((err = posix_spawnp(&cpid, cmd_argv[0], NULL, NULL, cmd_argv, environ))) {
-        char *fmt = "posix_spawnp(%s) on %s event";
-        int msglen = strlen(cmd_argv[0]) + strlen(fmt) + strlen(current_event);
-        char errmsg[msglen + 1];
-        snprintf(errmsg, msglen, "posix_spawnp(%s) on %s event", cmd_argv[0], current_event);
 
-        errno = err;
-        perror(errmsg);
+    const char *path = resolve_cmd(argv[0], 0);
+    for (;;) {
+        err = (path == NULL ? ENOENT :
+                posix_spawn(pid, path, NULL, spawn_attr(), argv,
+                            (envp ? envp : environ)));
+        if (!err || retried || (err != ENOENT && err != EACCES))
+            return err;
+        path = resolve_cmd(argv[0], 1);
+        retried = 1;
+    }
+}
+
+static void spawn_error(job *j, int err) {
+    char *fmt = "posix_spawn(%s) on %s event";
+    int msglen = strlen(j->argv[0]) + strlen(fmt) + strlen(j->event);
+    char errmsg[msglen + 1];
+    snprintf(errmsg, msglen, fmt, j->argv[0], j->event);
+
+    errno = err;
+    perror(errmsg);
+}
+
+static void zygote_exited(int status, int err, void *data);
+
+static int spawn_job(job *j) {
+    int err;
+
+    // Keep our output ordered before anything the handler prints.
+    output_flush();
+
+    // The zygote reports spawn errors along with the exit status.
+    j->pid = 0;
+    if (zygote_spawn(j->argv, j->envp, zygote_exited, j) == 0)
+        return 0;
+
+    if ((err = spawn_cmd(&j->pid, j->argv, j->envp))) {
+        spawn_error(j, err);
+        j->pid = 0;
+        return -1;
     }
+    return 0;
+}
+
+static int id_running(uint32_t id) {
+    job *j;
+    size_t i;
+    for (j = running; j; j = j->next)
+        for (i = 0; i < j->ids_len; i++)
+            if (j->ids[i] == id)
+                return 1;
+    return 0;
+}
+
+static int ids_running(job *j) {
+    size_t i;
+    for (i = 0; i < j->ids_len; i++)
+        if (id_running(j->ids[i]))
+            return 1;
+    return 0;
+}
 
-    // TODO: properly handle signals, like https://www.cons.org/cracauer/sigint.html
-    while ((err = wait(NULL)) == -1) {
-        if (errno != EINTR) {
-            perror("wait");
+static void pump_jobs(void);
+
+static void (*done_cb)(void) = NULL;
+
+/*
+ * Whether a job would start right away.  main.c holds events back while
+ * it would not, and done_cb tells it when a job has finished.
+ */
+extern int jobs_ready(void) {
+    return (jobs_opt == 0 || (pending == NULL && running_len < jobs_opt));
+}
+
+extern void jobs_on_done(void (*cb)(void)) {
+    done_cb = cb;
+}
+
+static void finish_job(job *j) {
+    job **jp;
+    for (jp = &running; *jp; jp = &(*jp)->next) {
+        if (*jp == j) {
+            *jp = j->next;
             break;
         }
     }
+    running_len--;
+
+    free_job(j);
+    pump_jobs();
+    if (done_cb)
+        done_cb();
+}
 
-    for (i = 0; i < fmt_len; i++)
-        free(cmd_argv[i+prefix_len]);
+static void reap_job(GPid pid, gint status, gpointer data) {
+    g_spawn_close_pid(pid);
+    finish_job(data);
+}
+
+static void zygote_exited(int status, int err, void *data) {
+    if (err)
+        spawn_error(data, err);
+    // Synchronous jobs are freed by run_job().
+    if (jobs_opt > 0)
+        finish_job(data);
+}
+
+static void pump_jobs(void) {
+    job **jp = &pending;
+    while (running_len < jobs_opt && *jp) {
+        job *j = *jp;
+        if (ids_running(j)) {
+            jp = &j->next;
+            continue;
+        }
+
+        *jp = j->next;
+        if (pending_tail == &j->next)
+            pending_tail = jp;
+
+        if (spawn_job(j) == -1) {
+            free_job(j);
+            continue;
+        }
+        j->next = running;
+        running = j;
+        running_len++;
+        if (j->pid)
+            handler_attach(g_child_watch_source_new(j->pid),
+                           (GSourceFunc) reap_job, j);
+    }
+}
+
+static void run_job(job *j) {
+    if (jobs_opt > 0) {
+        j->next = NULL;
+        *pending_tail = j;
+        pending_tail = &j->next;
+        pump_jobs();
+        return;
+    }
+
+    if (spawn_job(j) == 0) {
+        if (j->pid == 0) {
+            zygote_wait(j);
+        } else {
+            // TODO: properly handle signals, like https://www.cons.org/cracauer/sigint.html
+            while (waitpid(j->pid, NULL, 0) == -1) {
+                if (errno != EINTR) {
+                    perror("waitpid");
+                    break;
+                }
+            }
+        }
+    }
+    free_job(j);
+}
+
+/*
+ * Runs cmd once for all n events, with a group of formatted arguments for
+ * each.  With -e, n must be 1: the environment holds only one note.
+ */
+extern void run_batch(char *cmd, fmt_ctx **ctxs, size_t n) {
+    size_t prefix_len = (shell_run_opt ? 4 : 1);
+    const format *f   = ctxs[0]->fmt;
+    size_t fmt_len    = (use_env_opt   ? 0 : f->len);
+    size_t args_len   = fmt_len * n;
+    size_t i, k;
+
+    job *j = malloc(sizeof(job) + sizeof(char *) * (1 + prefix_len + args_len));
+    j->id = (ctxs[0]->n ? ctxs[0]->n->id : 0);
+    j->ids = &j->id;
+    j->ids_len = 1;
+    if (n > 1) {
+        j->ids = malloc(sizeof(uint32_t) * n);
+        for (k = 0; k < n; k++)
+            j->ids[k] = (ctxs[k]->n ? ctxs[k]->n->id : 0);
+        j->ids_len = n;
+    }
+    j->event = (ctxs[0]->event ? ctxs[0]->event : "unknown");
+    j->args = NULL;
+    j->envp = NULL;
+    j->env = NULL;
+
+    char **cmd_argv = j->argv;
+
+    static char *sh = NULL;
+    if (!sh && !(sh = getenv("SHELL")))
+        sh = "/bin/sh";
+
+    if (shell_run_opt) {
+        cmd_argv[0] = sh;
+        cmd_argv[1] = "-c";
+        cmd_argv[2] = cmd;
+        cmd_argv[3] = "notcat";
+    } else {
+        cmd_argv[0] = cmd;
+    }
+
+    // All arguments are formatted into one NUL-separated block, in a reused
+    // buffer unless the job is queued and may outlive this event.
+    size_t offs[args_len + 1];
+    if (args_len > 0) {
+        static buffer *args = NULL;
+        if (!args)
+            args = new_buffer(BUF_LEN);
+        reset_buffer(args);
+
+        for (k = 0; k < n; k++) {
+            for (i = 0; i < fmt_len; i++) {
+                offs[k * fmt_len + i] = buffer_len(args);
+                fmt_note_buf(args, &f->terms[i], ctxs[k]);
+                put_char(args, '\0');
+            }
+        }
+
+        size_t len;
+        char *block = (char *)buffer_view(args, &len);
+        if (jobs_opt > 0) {
+            j->args = malloc(len);
+            memcpy(j->args, block, len);
+            block = j->args;
+        }
+        for (i = 0; i < args_len; i++)
+            cmd_argv[i+prefix_len] = block + offs[i];
+    }
+    cmd_argv[args_len + prefix_len] = NULL;
+
+    if (use_env_opt)
+        build_env(j, ctxs[0]);
+
+    run_job(j);
+}
 
-    free(cmd_argv);
+extern void run_cmd(char *cmd, fmt_ctx *ctx) {
+    run_batch(cmd, &ctx, 1);
 }
@@ -0,0 +1,134 @@
+/* Copyright 2025 Jack Conger */
+
+/*
+ * This file is part of notcat.
+ *
+ * notcat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notcat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with notcat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * scan() finds the next "interesting" byte in a NUL-terminated string, so
+ * the text loops in markup.c and fmt.c can copy the runs in between in bulk.
+ *
+ * On x86 the string is read in aligned 16- or 32-byte blocks.  An aligned
+ * block never crosses a page boundary, so reading past the terminating NUL
+ * within the block is safe even though it is outside the string.  The
+ * implementation is picked at startup from what the CPU supports.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "libnotcat.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+typedef const char *(*scan_fn)(const char *, char, char, char);
+
+static const char *scan_scalar(const char *s, char a, char b, char c) {
+    for (; *s; s++) {
+        if (*s == a || *s == b || *s == c)
+            break;
+    }
+    return s;
+}
+
+#ifdef SCAN_X86
+
+__attribute__((target("sse2")))
+static const char *scan_sse2(const char *s, char a, char b, char c) {
+    uintptr_t off = (uintptr_t)s & 15;
+    const __m128i *p = (const __m128i *)(s - off);
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b),
+                  vc = _mm_set1_epi8(c), vz = _mm_setzero_si128();
+
+    unsigned mask = 0xFFFFu << off;
+    for (;; p++, mask = 0xFFFFu) {
+        __m128i v = _mm_load_si128(p);
+        __m128i m = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+                _mm_or_si128(_mm_cmpeq_epi8(v, vc), _mm_cmpeq_epi8(v, vz)));
+        unsigned hits = (unsigned)_mm_movemask_epi8(m) & mask;
+        if (hits)
+            return (const char *)p + __builtin_ctz(hits);
+    }
+}
+
+__attribute__((target("avx2")))
+static const char *scan_avx2(const char *s, char a, char b, char c) {
+    uintptr_t off = (uintptr_t)s & 31;
+    const __m256i *p = (const __m256i *)(s - off);
+    const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b),
+                  vc = _mm256_set1_epi8(c), vz = _mm256_setzero_si256();
+
+    uint32_t mask = 0xFFFFFFFFu << off;
+    for (;; p++, mask = 0xFFFFFFFFu) {
+        __m256i v = _mm256_load_si256(p);
+        __m256i m = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, vc), _mm256_cmpeq_epi8(v, vz)));
+        uint32_t hits = (uint32_t)_mm256_movemask_epi8(m) & mask;
+        if (hits)
+            return (const char *)p + __builtin_ctz(hits);
+    }
+}
+
+#endif
+
+static scan_fn scan_impl = scan_scalar;
+static const char *scan_impl_name = "scalar";
+
+extern int scan_select(const char *name) {
+    scan_fn f = NULL;
+    if (!strcmp(name, "scalar"))
+        f = scan_scalar;
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (!strcmp(name, "sse2") && __builtin_cpu_supports("sse2"))
+        f = scan_sse2;
+    if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2"))
+        f = scan_avx2;
+#endif
+    if (f == NULL)
+        return 0;
+
+    scan_impl = f;
+    scan_impl_name = name;
+    return 1;
+}
+
+/*
+ * The implementation is picked before main() runs rather than on first
+ * use, so that threads scanning at once never race to pick it.
+ */
+#ifdef SCAN_X86
+__attribute__((constructor))
+static void scan_auto(void) {
+    if (!scan_select("avx2"))
+        scan_select("sse2");
+}
+#endif
+
+extern const char *scan_name(void) {
+    return scan_impl_name;
+}
+
+extern const char *scan(const char *s, char a, char b, char c) {
+    return scan_impl(s, a, b, c);
+}
+
+/* vim: set ft=c tabstop=4 softtabstop=4 shiftwidth=4 expandtab textwidth=0: */
@@ -0,0 +1,546 @@
+/* Copyright 2025 Jack Conger */
+
+/*
+ * This file is part of notcat.
+ *
+ * notcat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notcat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with notcat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Sinks for the built-in echo, in place of standard output.
+ *
+ *  --sink=stdout[,<opt>...]
+ *  --sink=file:<path>[,<opt>...]   append to <path>
+ *  --sink=fifo:<path>[,<opt>...]   write to the FIFO <path>, made if need be
+ *  --sink=unix:<path>[,<opt>...]   connect to the stream socket <path>
+ *
+ *  queue=<n>                       hold up to n lines (default: 64)
+ *  full=drop-oldest|drop-newest|block
+ *                                  what to do with a line when n are held
+ *                                  (default: drop-oldest)
+ *  format=<format>                 format lines with <format> instead; it
+ *                                  comes last, and may contain commas
+ *
+ * Every sink's fd is non-blocking.  A line is written straight away when
+ * its sink holds nothing, and otherwise waits in the sink's ring until the
+ * fd is writable, so a slow reader holds up nobody but itself -- unless
+ * its sink is full=block, which waits for the reader once the ring is full.
+ * That wait would hold up the bus, so full=block needs --worker.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+#include "notcat.h"
+
+#define SINK_STDOUT 0
+#define SINK_FILE   1
+#define SINK_FIFO   2
+#define SINK_UNIX   3
+
+#define FULL_DROP_OLDEST    0
+#define FULL_DROP_NEWEST    1
+#define FULL_BLOCK          2
+
+#define QUEUE_DEFAULT   64
+#define QUEUE_MAX       (1 << 20)
+#define IOV_CHUNK       64
+
+typedef struct _line {
+    char *s;
+    size_t len;
+} line;
+
+typedef struct _sink {
+    char *name;         /* the spec up to its options, for messages */
+    int kind;
+    char *path;
+    char *fmt_str;      /* NULL for notcat's format arguments */
+    format fmt;
+    int full;
+
+    int fd;             /* -1 when not open */
+    guint out_watch;
+    line *ring;
+    size_t cap, head, len;
+    size_t off;         /* bytes of the head line already written */
+    gint dropped;       /* read by print_stats() on the bus thread */
+
+    struct _sink *next;
+} sink;
+
+static sink *sinks = NULL;
+static sink **sinks_tail = &sinks;
+
+extern int sink_add(const char *spec) {
+    sink *s = calloc(1, sizeof(sink));
+    const char *p;
+    size_t n;
+
+    s->fd = -1;
+    s->cap = QUEUE_DEFAULT;
+    s->full = FULL_DROP_OLDEST;
+
+    n = strcspn(spec, ":,");
+    if (n == 6 && !strncmp(spec, "stdout", 6))
+        s->kind = SINK_STDOUT;
+    else if (n == 4 && !strncmp(spec, "file", 4))
+        s->kind = SINK_FILE;
+    else if (n == 4 && !strncmp(spec, "fifo", 4))
+        s->kind = SINK_FIFO;
+    else if (n == 4 && !strncmp(spec, "unix", 4))
+        s->kind = SINK_UNIX;
+    else
+        goto bad;
+
+    p = spec + n;
+    if (s->kind == SINK_STDOUT ? *p == ':' : *p != ':')
+        goto bad;
+    if (*p == ':') {
+        n = strcspn(++p, ",");
+        if (n == 0)
+            goto bad;
+        s->path = g_strndup(p, n);
+        p += n;
+    }
+    s->name = g_strndup(spec, p - spec);
+
+    while (*p == ',') {
+        p++;
+        if (!strncmp(p, "format=", 7)) {
+            s->fmt_str = g_strdup(p + 7);
+            p += strlen(p);
+            break;
+        }
+        n = strcspn(p, ",");
+        if (!strncmp(p, "queue=", 6)) {
+            char *end;
+            unsigned long q = strtoul(p + 6, &end, 10);
+            if (n == 6 || end != p + n || q == 0 || q > QUEUE_MAX)
+                goto bad;
+            s->cap = q;
+        } else if (n == 16 && !strncmp(p, "full=drop-oldest", n)) {
+            s->full = FULL_DROP_OLDEST;
+        } else if (n == 16 && !strncmp(p, "full=drop-newest", n)) {
+            s->full = FULL_DROP_NEWEST;
+        } else if (n == 10 && !strncmp(p, "full=block", n)) {
+            s->full = FULL_BLOCK;
+        } else {
+            goto bad;
+        }
+        p += n;
+    }
+    if (*p != '\0')
+        goto bad;
+
+    s->ring = malloc(sizeof(line) * s->cap);
+    *sinks_tail = s;
+    sinks_tail = &s->next;
+    return 1;
+
+bad:
+    g_free(s->path);
+    g_free(s->name);
+    g_free(s->fmt_str);
+    free(s);
+    return 0;
+}
+
+extern int sinks_active(void) {
+    return sinks != NULL;
+}
+
+/*
+ * Compiles the format arguments together with each sink's own format, so
+ * that they all share hint and action slots: one note_copy, and one
+ * fmt_ctx, then serves every sink.  Returns the whole, and sets *main to
+ * the format arguments' terms within it.
+ */
+extern format sink_parse_formats(format *main, size_t len, char **strs) {
+    size_t n = len;
+    sink *s;
+
+    for (s = sinks; s; s = s->next)
+        if (s->fmt_str)
+            n++;
+    char **all = malloc(sizeof(char *) * n);
+    memcpy(all, strs, sizeof(char *) * len);
+    n = len;
+    for (s = sinks; s; s = s->next)
+        if (s->fmt_str)
+            all[n++] = s->fmt_str;
+
+    format f = parse_format(n, all);
+    free(all);
+
+    *main = f;
+    main->len = len;
+    n = len;
+    for (s = sinks; s; s = s->next) {
+        s->fmt = *main;
+        if (s->fmt_str) {
+            s->fmt.terms = f.terms + n++;
+            s->fmt.len = 1;
+        }
+    }
+    return f;
+}
+
+static int sink_connect(sink *s) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(s->path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, s->path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Opens standard output afresh, so that making it non-blocking doesn't
+ * change it for the shell or for our handlers, which share its open file
+ * description.  A regular file never blocks, so a dup does for that; so it
+ * must for anything /proc can't open again, such as a socket, though then
+ * writes to it may block.
+ */
+static int open_stdout(int *blocking) {
+    struct stat st;
+    int fd = -1;
+
+    fflush(stdout);
+    *blocking = 0;
+    if (fstat(STDOUT_FILENO, &st) == -1)
+        return -1;
+    if (!S_ISREG(st.st_mode)
+            && (fd = open("/proc/self/fd/1", O_WRONLY | O_NONBLOCK)) != -1)
+        return fd;
+
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "notcat: sink stdout: can't reopen standard output; "
+                "writes to it may block\n");
+        *blocking = 1;
+    }
+    return dup(STDOUT_FILENO);
+}
+
+static int sink_open(sink *s) {
+    int fd, blocking = 0;
+
+    switch (s->kind) {
+    case SINK_STDOUT:
+        fd = open_stdout(&blocking);
+        break;
+    case SINK_FILE:
+        fd = open(s->path, O_WRONLY | O_APPEND | O_CREAT, 0666);
+        break;
+    case SINK_FIFO:
+        if (mkfifo(s->path, 0666) == -1 && errno != EEXIST)
+            return -1;
+        /*
+         * Opened for reading as well, as Linux allows, so that this
+         * doesn't wait for a reader, and a reader going away doesn't close
+         * the FIFO on us: the next reader carries on where it left off.
+         */
+        fd = open(s->path, O_RDWR);
+        break;
+    default:
+        fd = sink_connect(s);
+    }
+    if (fd == -1)
+        return -1;
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (!blocking)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    s->fd = fd;
+    return 0;
+}
+
+static void drop_line(sink *s) {
+    free(s->ring[s->head].s);
+    s->head = (s->head + 1) % s->cap;
+    s->len--;
+    s->off = 0;
+    g_atomic_int_inc(&s->dropped);
+}
+
+/* The fd failed: drop what it held.  Only a socket is opened again. */
+static void sink_lost(sink *s) {
+    fprintf(stderr, "notcat: sink %s: %s\n", s->name, strerror(errno));
+    if (s->out_watch) {
+        handler_source_remove(s->out_watch);
+        s->out_watch = 0;
+    }
+    close(s->fd);
+    s->fd = -1;
+    while (s->len > 0)
+        drop_line(s);
+}
+
+static gboolean sink_writable(gint fd, GIOCondition cond, gpointer data);
+
+/* Writes what the ring holds, as far as the fd takes it. */
+static void sink_flush(sink *s) {
+    while (s->len > 0) {
+        struct iovec iov[IOV_CHUNK];
+        size_t i, n = (s->len < IOV_CHUNK ? s->len : IOV_CHUNK);
+        for (i = 0; i < n; i++) {
+            line *l = &s->ring[(s->head + i) % s->cap];
+            iov[i].iov_base = l->s;
+            iov[i].iov_len = l->len;
+        }
+        iov[0].iov_base = s->ring[s->head].s + s->off;
+        iov[0].iov_len -= s->off;
+
+        ssize_t w = writev(s->fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!s->out_watch)
+                    s->out_watch = handler_attach(
+                            g_unix_fd_source_new(s->fd, G_IO_OUT),
+                            (GSourceFunc) sink_writable, s);
+                return;
+            }
+            sink_lost(s);
+            return;
+        }
+        while (w > 0) {
+            line *l = &s->ring[s->head];
+            size_t left = l->len - s->off;
+            if ((size_t) w < left) {
+                s->off += w;
+                break;
+            }
+            w -= left;
+            free(l->s);
+            s->head = (s->head + 1) % s->cap;
+            s->len--;
+            s->off = 0;
+        }
+    }
+}
+
+static gboolean sink_writable(gint fd, GIOCondition cond, gpointer data) {
+    sink *s = data;
+    s->out_watch = 0;
+    sink_flush(s);
+    return G_SOURCE_REMOVE;
+}
+
+/* Waits until the reader makes room in the ring, for full=block. */
+static void sink_wait(sink *s) {
+    struct pollfd p = { .fd = s->fd, .events = POLLOUT };
+    while (s->fd != -1 && s->len == s->cap) {
+        if (poll(&p, 1, -1) == -1 && errno != EINTR)
+            return;
+        sink_flush(s);
+    }
+}
+
+/* Makes room for one more line, if the sink's policy allows it. */
+static int sink_room(sink *s) {
+    if (s->len < s->cap)
+        return 1;
+
+    switch (s->full) {
+    case FULL_BLOCK:
+        sink_wait(s);
+        break;
+    case FULL_DROP_OLDEST:
+        if (s->off == 0) {
+            drop_line(s);
+        } else if (s->cap > 1) {
+            // The head is partly written; drop the line after it instead.
+            size_t next = (s->head + 1) % s->cap;
+            free(s->ring[next].s);
+            s->ring[next] = s->ring[s->head];
+            s->head = next;
+            s->len--;
+            g_atomic_int_inc(&s->dropped);
+        }
+        break;
+    }
+    return (s->fd != -1 && s->len < s->cap);
+}
+
+/* Queues the line in iov, after skipping 'skip' bytes already written. */
+static void sink_push(sink *s, struct iovec *iov, size_t iovlen,
+                      size_t len, size_t skip) {
+    line *l = &s->ring[(s->head + s->len) % s->cap];
+    char *p;
+    size_t i;
+
+    l->len = len - skip;
+    p = l->s = malloc(l->len);
+    for (i = 0; i < iovlen; i++) {
+        const char *b = iov[i].iov_base;
+        size_t n = iov[i].iov_len;
+        if (skip >= n) {
+            skip -= n;
+            continue;
+        }
+        memcpy(p, b + skip, n - skip);
+        p += n - skip;
+        skip = 0;
+    }
+    s->len++;
+}
+
+static void sink_write(sink *s, struct iovec *iov, size_t iovlen) {
+    size_t i, len = 0;
+    ssize_t w = 0;
+
+    for (i = 0; i < iovlen; i++)
+        len += iov[i].iov_len;
+
+    if (s->fd == -1 && s->kind == SINK_UNIX)
+        sink_open(s);
+    if (s->fd == -1) {
+        g_atomic_int_inc(&s->dropped);
+        return;
+    }
+
+    if (s->len > 0) {
+        if (!sink_room(s)) {
+            g_atomic_int_inc(&s->dropped);
+            return;
+        }
+        sink_push(s, iov, iovlen, len, 0);
+        return;
+    }
+
+    while (iovlen > 0 && (w = writev(s->fd, iov, iovlen)) < 0 && errno == EINTR)
+        ;
+    if (w < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            sink_lost(s);
+            g_atomic_int_inc(&s->dropped);
+            return;
+        }
+        w = 0;
+    }
+    if ((size_t) w == len)
+        return;
+    sink_push(s, iov, iovlen, len, w);
+    sink_flush(s);
+}
+
+/* Writes what it can of each ring without waiting, then exits. */
+static gboolean terminate(gpointer data) {
+    sink *s;
+    for (s = sinks; s; s = s->next)
+        if (s->fd != -1)
+            sink_flush(s);
+    exit(0);
+}
+
+extern void sink_start(void) {
+    sink *s;
+
+    if (!sinks)
+        return;
+    for (s = sinks; s; s = s->next) {
+        if (s->full == FULL_BLOCK && !worker_opt) {
+            fprintf(stderr, "notcat: sink %s: full=block needs --worker\n",
+                    s->name);
+            exit(2);
+        }
+        if (sink_open(s) == -1) {
+            fprintf(stderr, "notcat: sink %s: %s\n", s->name, strerror(errno));
+            // A socket's reader may turn up later; it's tried for each line.
+            if (s->kind != SINK_UNIX)
+                exit(1);
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    handler_attach(g_unix_signal_source_new(SIGINT), terminate, NULL);
+    handler_attach(g_unix_signal_source_new(SIGTERM), terminate, NULL);
+}
+
+/*
+ * Writes the event to every sink.  Sinks with notcat's format arguments
+ * share one rendering of the line; each sink format renders its own.
+ */
+extern void sink_print(fmt_ctx *ctx) {
+    static fmt_iov main_v, own_v;
+    static int v_init = 0;
+    const format *f = ctx->fmt;
+    int main_done = 0;
+    sink *s;
+
+    if (!v_init) {
+        fmt_iov_init(&main_v);
+        fmt_iov_init(&own_v);
+        v_init = 1;
+    }
+
+    for (s = sinks; s; s = s->next) {
+        fmt_iov *v = &main_v;
+        // Every sink format shares the slots of ctx's, so ctx serves it.
+        ctx->fmt = &s->fmt;
+        if (s->fmt_str) {
+            v = &own_v;
+            fmt_iov_reset(v, ctx->fmt);
+            put_note_line(v, ctx);
+        } else if (!main_done) {
+            fmt_iov_reset(v, ctx->fmt);
+            put_note_line(v, ctx);
+            main_done = 1;
+        }
+        sink_write(s, v->iov, v->len);
+    }
+    ctx->fmt = f;
+}
+
+extern void sink_print_stats(void) {
+    sink *s;
+    for (s = sinks; s; s = s->next) {
+        int dropped = g_atomic_int_get(&s->dropped);
+        if (dropped > 0)
+            fprintf(stderr, "notcat: sink %s: %d lines dropped\n",
+                    s->name, dropped);
+    }
+}
+
+/* vim: set ft=c tabstop=4 softtabstop=4 shiftwidth=4 expandtab textwidth=0: */
@@ -19,6 +19,11 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <glib.h>
 
 #include "notcat.h"
 
@@ -34,11 +39,29 @@ void cmp_fmt(char *in, char *want) {
         fprintf(stderr, "FAILED: %s produced format of length != 1", in);
         return;
     }
-    char *out = fmt_note(fmt.terms, &note);
+    fmt_ctx ctx;
+    fmt_ctx_init(&ctx, &fmt, &note);
+    char *out = fmt_note(fmt.terms, &ctx);
+
+    /* the iovec path must render the same thing */
+    fmt_iov v;
+    fmt_iov_init(&v);
+    fmt_iov_reset(&v, &fmt);
+    fmt_note_iov(&v, fmt.terms, &ctx);
+    char iov_out[256] = "";
+    for (size_t i = 0; i < v.len; i++)
+        strncat(iov_out, v.iov[i].iov_base, v.iov[i].iov_len);
+    fmt_ctx_free(&ctx);
+    free_format(&fmt);
+
     if (strcmp(out, want)) {
         fprintf(stderr, "FAILED: %s => %s -- got %s\n", in, want, out);
         return;
     }
+    if (strcmp(iov_out, want)) {
+        fprintf(stderr, "FAILED: %s => %s -- got %s from iovecs\n", in, want, iov_out);
+        return;
+    }
     fprintf(stderr, "passed: %s => %s\n", in, want);
     return;
 }
@@ -67,8 +90,137 @@ void test_fmt() {
     cmp_fmt("%(?B:havebody)after", "havebodyafter");
     cmp_fmt("%(?B:%B)", "body");
     cmp_fmt("%(?B:%(B))", "body");
+
+    cmp_fmt("%(?s:a%(?a:b)c)d", "acd");
+    cmp_fmt("%(?a:a%(?s:b)c)d", "d");
+    cmp_fmt("x%(?a:y)z%%", "xz%");
+    cmp_fmt("%i:%(?s:%s)", "13:summary");
+    cmp_fmt("%i%i%i", "131313");
+}
+
+void cmp_signal(char *in, fmt_signal sig, char *want) {
+    format fmt = parse_format(1, &in);
+    fmt_ctx ctx;
+    fmt_ctx_init(&ctx, &fmt, NULL);
+    ctx.sig = &sig;
+    char *out = fmt_note(fmt.terms, &ctx);
+    fmt_ctx_free(&ctx);
+    free_format(&fmt);
+
+    if (strcmp(out, want)) {
+        fprintf(stderr, "FAILED: signal %s => %s -- got %s\n", in, want, out);
+        return;
+    }
+    fprintf(stderr, "passed: signal %s => %s\n", in, want);
+}
+
+void test_signal() {
+    fmt_signal closed = { .id = 7, .reason = "dismissed" };
+    fmt_signal invoked = { .id = 7, .key = "default" };
+    char *listen = "%(?r:closed %i (%r))%(?k:invoked %i %k)";
+
+    cmp_signal(listen, closed, "closed 7 (dismissed)");
+    cmp_signal(listen, invoked, "invoked 7 default");
+    cmp_signal("%i %(r)%(k)", closed, "7 dismissed");
+    cmp_signal("%s%b%(?s:x)%(?c:y)", closed, "");
+}
+
+void cmp_markup(char *in, char *want) {
+    char out[strlen(in) + 1];
+    int ok = markup_body(in, out);
+    if ((want == NULL) != (ok == -1) || (want && strcmp(out, want))) {
+        fprintf(stderr, "FAILED: markup %s => %s -- got %s\n", in,
+                want ? want : "(raw)", ok == -1 ? "(raw)" : out);
+        return;
+    }
+    fprintf(stderr, "passed: markup %s => %s\n", in, want ? want : "(raw)");
+}
+
+void test_markup() {
+    cmp_markup("plain", "plain");
+    cmp_markup("<b>bold</b> &amp; <i>it</i>", "bold & it");
+    cmp_markup("<a href=\"x\">link</a>", "link");
+    cmp_markup("a\n\n<b>\n</b>b", "a b");
+    cmp_markup("&foo; &lt;", "&foo; <");
+    cmp_markup("<b>unclosed", NULL);
+    cmp_markup("<b>wrong</i>", NULL);
+    cmp_markup("stray</b>", NULL);
+    cmp_markup("<b", NULL);
+
+    /* used to overflow a fixed 50-child array */
+    char many[60 * 8 + 1] = "";
+    char want[60 + 1] = "";
+    for (int i = 0; i < 60; i++) {
+        strcat(many, "<b>x</b>");
+        strcat(want, "x");
+    }
+    cmp_markup(many, want);
+}
+
+/* stands in for dispatch(), which handles one event per idle call */
+gboolean burst_cb(gpointer data) {
+    int *left = data;
+    struct iovec iov = { .iov_base = "line\n", .iov_len = 5 };
+    output_write(&iov, 1);
+    return --*left > 0 ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+void test_flush_size() {
+    int fds[2], left = 20, writes = 0;
+    char buf[256];
+
+    /* each write(2) arrives as one record */
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0) {
+        perror("socketpair");
+        return;
+    }
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    dup2(fds[0], STDOUT_FILENO);
+
+    output_set_policy("size:4096");
+    g_idle_add(burst_cb, &left);
+    while (g_main_context_iteration(NULL, FALSE))
+        ;
+
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(fds[0]);
+    while (recv(fds[1], buf, sizeof buf, MSG_DONTWAIT) > 0)
+        writes++;
+    close(fds[1]);
+    output_set_policy("event");
+
+    if (writes != 1) {
+        fprintf(stderr, "FAILED: --flush=size burst of 20 => 1 write -- got %d\n", writes);
+        return;
+    }
+    fprintf(stderr, "passed: --flush=size burst of 20 => 1 write\n");
+}
+
+void test_limit_close() {
+    NLNote note = { .id = 5, .appname = "app" };
+    int ok = 1;
+
+    limit_set_rate("1/60");
+    ok &= (limit_take(&note, NULL) == LIMIT_PASS);
+    ok &= (limit_take(&note, NULL) == LIMIT_DROP);   /* the replace */
+    ok &= (limit_close(5) == 1);
+    note.id = 6;
+    ok &= (limit_take(&note, NULL) == LIMIT_DROP);
+    ok &= (limit_close(6) == 0);
+
+    if (!ok) {
+        fprintf(stderr, "FAILED: limit closes only notifies that were all shed\n");
+        return;
+    }
+    fprintf(stderr, "passed: limit closes only notifies that were all shed\n");
 }
 
 int main() {
     test_fmt();
+    test_signal();
+    test_markup();
+    test_flush_size();
+    test_limit_close();
 }
@@ -0,0 +1,820 @@
+/* Copyright 2019 Jack Conger */
+
+/*
+ * This file is part of notcat.
+ *
+ * notcat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notcat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with notcat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A minimal D-Bus client for the one-shot client commands.  Making a
+ * single call through GIO means setting up the type system, a connection
+ * with its worker thread, and a proxy, all before the call is sent.  This
+ * speaks the wire protocol directly instead: connect to the session bus
+ * socket, authenticate with EXTERNAL, then send Hello and the call itself
+ * in one write.
+ *
+ * Arguments and results are GVariants, which need only GLib.  Only unix
+ * socket addresses are understood; wire_open() returns NULL for anything
+ * else, and the caller is expected to fall back to GIO.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <glib.h>
+
+#include "notcat.h"
+
+#define WIRE_TIMEOUT 25         /* seconds; the same as GDBus */
+#define WIRE_MAX_MSG (128 << 20)
+#define WIRE_MAX_DEPTH 64
+
+#define MSG_METHOD_CALL   1
+#define MSG_METHOD_RETURN 2
+#define MSG_ERROR         3
+
+#define FIELD_PATH         1
+#define FIELD_INTERFACE    2
+#define FIELD_MEMBER       3
+#define FIELD_ERROR_NAME   4
+#define FIELD_REPLY_SERIAL 5
+#define FIELD_DESTINATION  6
+#define FIELD_SIGNATURE    8
+
+struct _wire {
+    int fd;
+    uint32_t serial;
+    uint32_t hello;     /* serial of a Hello not yet answered, or 0 */
+    buffer *out;        /* written out with the next call */
+    buffer *head;
+    buffer *body;
+};
+
+/*
+ * Marshalling.  Messages are built in our own byte order, and alignment is
+ * relative to the start of the buffer, which is always 8-aligned within
+ * the message.
+ */
+
+static size_t type_align(char t) {
+    switch (t) {
+    case 'n': case 'q':
+        return 2;
+    case 'b': case 'i': case 'u': case 'h':
+    case 's': case 'o': case 'a':
+        return 4;
+    case 'x': case 't': case 'd':
+    case '(': case '{':
+        return 8;
+    default:
+        return 1;
+    }
+}
+
+static void put_pad(buffer *b, size_t align) {
+    while (buffer_len(b) % align)
+        put_char(b, '\0');
+}
+
+static void put_fixed(buffer *b, size_t len, const void *p) {
+    put_pad(b, len);
+    put_strn(b, len, p);
+}
+
+static void put_u32(buffer *b, uint32_t u) {
+    put_fixed(b, 4, &u);
+}
+
+/* Returns 0, or -1 for a value which D-Bus cannot carry. */
+static int put_value(buffer *b, GVariant *v) {
+    union {
+        uint16_t q;
+        uint32_t u;
+        uint64_t t;
+        double d;
+    } n;
+    const char *s;
+    gsize len;
+
+    switch (g_variant_classify(v)) {
+    case G_VARIANT_CLASS_BOOLEAN:
+        put_u32(b, g_variant_get_boolean(v) ? 1 : 0);
+        return 0;
+    case G_VARIANT_CLASS_BYTE:
+        put_char(b, g_variant_get_byte(v));
+        return 0;
+    case G_VARIANT_CLASS_INT16:
+        n.q = g_variant_get_int16(v);
+        put_fixed(b, 2, &n.q);
+        return 0;
+    case G_VARIANT_CLASS_UINT16:
+        n.q = g_variant_get_uint16(v);
+        put_fixed(b, 2, &n.q);
+        return 0;
+    case G_VARIANT_CLASS_INT32:
+        n.u = g_variant_get_int32(v);
+        put_u32(b, n.u);
+        return 0;
+    case G_VARIANT_CLASS_UINT32:
+        put_u32(b, g_variant_get_uint32(v));
+        return 0;
+    case G_VARIANT_CLASS_HANDLE:
+        n.u = g_variant_get_handle(v);
+        put_u32(b, n.u);
+        return 0;
+    case G_VARIANT_CLASS_INT64:
+        n.t = g_variant_get_int64(v);
+        put_fixed(b, 8, &n.t);
+        return 0;
+    case G_VARIANT_CLASS_UINT64:
+        n.t = g_variant_get_uint64(v);
+        put_fixed(b, 8, &n.t);
+        return 0;
+    case G_VARIANT_CLASS_DOUBLE:
+        n.d = g_variant_get_double(v);
+        put_fixed(b, 8, &n.d);
+        return 0;
+    case G_VARIANT_CLASS_STRING:
+    case G_VARIANT_CLASS_OBJECT_PATH:
+        s = g_variant_get_string(v, &len);
+        put_u32(b, len);
+        put_strn(b, len + 1, s);
+        return 0;
+    case G_VARIANT_CLASS_SIGNATURE:
+        s = g_variant_get_string(v, &len);
+        put_char(b, len);
+        put_strn(b, len + 1, s);
+        return 0;
+    case G_VARIANT_CLASS_VARIANT: {
+        GVariant *inner = g_variant_get_variant(v);
+        s = g_variant_get_type_string(inner);
+        put_char(b, strlen(s));
+        put_strn(b, strlen(s) + 1, s);
+        int r = put_value(b, inner);
+        g_variant_unref(inner);
+        return r;
+    }
+    case G_VARIANT_CLASS_ARRAY: {
+        size_t at, start, i;
+        put_u32(b, 0);
+        at = buffer_len(b) - 4;
+        put_pad(b, type_align(g_variant_get_type_string(v)[1]));
+        start = buffer_len(b);
+
+        len = g_variant_n_children(v);
+        for (i = 0; i < len; i++) {
+            GVariant *c = g_variant_get_child_value(v, i);
+            int r = put_value(b, c);
+            g_variant_unref(c);
+            if (r)
+                return r;
+        }
+
+        n.u = buffer_len(b) - start;
+        memcpy((char *) buffer_view(b, NULL) + at, &n.u, 4);
+        return 0;
+    }
+    case G_VARIANT_CLASS_TUPLE:
+    case G_VARIANT_CLASS_DICT_ENTRY: {
+        size_t i;
+        put_pad(b, 8);
+        len = g_variant_n_children(v);
+        for (i = 0; i < len; i++) {
+            GVariant *c = g_variant_get_child_value(v, i);
+            int r = put_value(b, c);
+            g_variant_unref(c);
+            if (r)
+                return r;
+        }
+        return 0;
+    }
+    default:
+        /* maybe types have no D-Bus representation */
+        return -1;
+    }
+}
+
+/* Appends a method call to w->out.  Returns 0, or -1 if args are invalid. */
+static int put_message(wire *w, uint32_t serial, const char *dest,
+                       const char *path, const char *iface,
+                       const char *member, GVariant *args) {
+    GVariantBuilder f;
+    const char *sig = NULL;
+    size_t sig_len = 0;
+
+    reset_buffer(w->body);
+    if (args != NULL && g_variant_n_children(args) > 0) {
+        if (put_value(w->body, args))
+            return -1;
+        /* the body signature is that of the tuple, minus the parens */
+        sig = g_variant_get_type_string(args) + 1;
+        sig_len = strlen(sig) - 1;
+    }
+
+    g_variant_builder_init(&f, G_VARIANT_TYPE("a(yv)"));
+    g_variant_builder_add(&f, "(yv)", FIELD_PATH,
+            g_variant_new_object_path(path));
+    if (iface != NULL)
+        g_variant_builder_add(&f, "(yv)", FIELD_INTERFACE,
+                g_variant_new_string(iface));
+    g_variant_builder_add(&f, "(yv)", FIELD_MEMBER,
+            g_variant_new_string(member));
+    g_variant_builder_add(&f, "(yv)", FIELD_DESTINATION,
+            g_variant_new_string(dest));
+    if (sig != NULL) {
+        char *s = g_strndup(sig, sig_len);
+        g_variant_builder_add(&f, "(yv)", FIELD_SIGNATURE,
+                g_variant_new_signature(s));
+        g_free(s);
+    }
+    GVariant *fields = g_variant_ref_sink(g_variant_builder_end(&f));
+
+    // Alignment is relative to the start of the message, so the header is
+    // built on its own rather than straight into 'out'.
+    buffer *b = w->head;
+    reset_buffer(b);
+    put_char(b, G_BYTE_ORDER == G_LITTLE_ENDIAN ? 'l' : 'B');
+    put_char(b, MSG_METHOD_CALL);
+    put_char(b, 0);
+    put_char(b, 1);
+    put_u32(b, buffer_len(w->body));
+    put_u32(b, serial);
+    put_value(b, fields);
+    put_pad(b, 8);
+    g_variant_unref(fields);
+
+    size_t len;
+    const char *p = buffer_view(b, &len);
+    put_strn(w->out, len, p);
+    p = buffer_view(w->body, &len);
+    put_strn(w->out, len, p);
+    return 0;
+}
+
+/*
+ * Demarshalling, into GVariants of the same types GIO would produce.
+ */
+
+typedef struct {
+    const unsigned char *data;
+    size_t len, pos;
+    int swap;
+    int depth;
+} reader;
+
+static int get_pad(reader *r, size_t align) {
+    size_t to = (r->pos + align - 1) / align * align;
+    if (to > r->len)
+        return 0;
+    for (; r->pos < to; r->pos++)
+        if (r->data[r->pos] != '\0')
+            return 0;
+    return 1;
+}
+
+static int get_fixed(reader *r, size_t len, void *p) {
+    if (!get_pad(r, len) || r->len - r->pos < len)
+        return 0;
+    memcpy(p, r->data + r->pos, len);
+    r->pos += len;
+
+    if (r->swap) {
+        unsigned char *c = p, t;
+        size_t i;
+        for (i = 0; i < len / 2; i++) {
+            t = c[i];
+            c[i] = c[len - 1 - i];
+            c[len - 1 - i] = t;
+        }
+    }
+    return 1;
+}
+
+/* Returns the string, NUL-terminated in place, or NULL. */
+static const char *get_str(reader *r, size_t len) {
+    if (r->len - r->pos < len + 1 || r->data[r->pos + len] != '\0')
+        return NULL;
+    const char *s = (const char *) r->data + r->pos;
+    if (memchr(s, '\0', len) != NULL)
+        return NULL;
+    r->pos += len + 1;
+    return s;
+}
+
+/* Reads one value of the complete type at *sig, advancing *sig past it. */
+static GVariant *get_value(reader *r, const char **sig) {
+    union {
+        unsigned char y;
+        uint16_t q;
+        uint32_t u;
+        uint64_t t;
+        double d;
+    } n;
+    const char *s;
+    char t = **sig;
+
+    if (++r->depth > WIRE_MAX_DEPTH)
+        return NULL;
+
+    GVariant *v = NULL;
+    (*sig)++;
+    switch (t) {
+    case 'y':
+        if (get_fixed(r, 1, &n.y))
+            v = g_variant_new_byte(n.y);
+        break;
+    case 'b':
+        if (get_fixed(r, 4, &n.u) && n.u <= 1)
+            v = g_variant_new_boolean(n.u);
+        break;
+    case 'n':
+        if (get_fixed(r, 2, &n.q))
+            v = g_variant_new_int16(n.q);
+        break;
+    case 'q':
+        if (get_fixed(r, 2, &n.q))
+            v = g_variant_new_uint16(n.q);
+        break;
+    case 'i':
+        if (get_fixed(r, 4, &n.u))
+            v = g_variant_new_int32(n.u);
+        break;
+    case 'u':
+        if (get_fixed(r, 4, &n.u))
+            v = g_variant_new_uint32(n.u);
+        break;
+    case 'h':
+        if (get_fixed(r, 4, &n.u))
+            v = g_variant_new_handle(n.u);
+        break;
+    case 'x':
+        if (get_fixed(r, 8, &n.t))
+            v = g_variant_new_int64(n.t);
+        break;
+    case 't':
+        if (get_fixed(r, 8, &n.t))
+            v = g_variant_new_uint64(n.t);
+        break;
+    case 'd':
+        if (get_fixed(r, 8, &n.d))
+            v = g_variant_new_double(n.d);
+        break;
+    case 's':
+        if (get_fixed(r, 4, &n.u) && (s = get_str(r, n.u))
+                && g_utf8_validate(s, n.u, NULL))
+            v = g_variant_new_string(s);
+        break;
+    case 'o':
+        if (get_fixed(r, 4, &n.u) && (s = get_str(r, n.u))
+                && g_variant_is_object_path(s))
+            v = g_variant_new_object_path(s);
+        break;
+    case 'g':
+        if (get_fixed(r, 1, &n.y) && (s = get_str(r, n.y))
+                && g_variant_is_signature(s))
+            v = g_variant_new_signature(s);
+        break;
+    case 'v': {
+        const char *end;
+        if (!get_fixed(r, 1, &n.y) || !(s = get_str(r, n.y)))
+            break;
+        if (!g_variant_type_string_scan(s, NULL, &end) || *end != '\0')
+            break;
+        GVariant *inner = get_value(r, &s);
+        if (inner != NULL)
+            v = g_variant_new_variant(inner);
+        break;
+    }
+    case 'a': {
+        const char *elem = *sig, *end = NULL;
+        size_t stop;
+        GVariantBuilder b;
+
+        if (!g_variant_type_string_scan(elem, NULL, &end))
+            break;
+        *sig = end;
+        if (!get_fixed(r, 4, &n.u) || !get_pad(r, type_align(*elem))
+                || r->len - r->pos < n.u)
+            break;
+
+        g_variant_builder_init(&b, (const GVariantType *) (elem - 1));
+        stop = r->pos + n.u;
+        int ok = 1;
+        while (ok && r->pos < stop) {
+            const char *es = elem;
+            GVariant *c = get_value(r, &es);
+            if ((ok = (c != NULL)))
+                g_variant_builder_add_value(&b, c);
+        }
+        if (!ok || r->pos != stop) {
+            g_variant_builder_clear(&b);
+            break;
+        }
+        v = g_variant_builder_end(&b);
+        break;
+    }
+    case '(': case '{': {
+        GVariantBuilder b;
+        g_variant_builder_init(&b, (const GVariantType *) (*sig - 1));
+        if (!get_pad(r, 8)) {
+            g_variant_builder_clear(&b);
+            break;
+        }
+        int ok = 1;
+        while (ok && **sig != ')' && **sig != '}') {
+            GVariant *c = get_value(r, sig);
+            if ((ok = (c != NULL)))
+                g_variant_builder_add_value(&b, c);
+        }
+        if (!ok) {
+            g_variant_builder_clear(&b);
+            break;
+        }
+        (*sig)++;
+        v = g_variant_builder_end(&b);
+        break;
+    }
+    }
+
+    r->depth--;
+    return v;
+}
+
+/*
+ * The connection.
+ */
+
+static int write_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *p, size_t len) {
+    char *c = p;
+    while (len > 0) {
+        ssize_t n = read(fd, c, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == 0)
+            errno = ECONNRESET;
+        if (n <= 0)
+            return -1;
+        c += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Undoes the %XX escaping of address values, in place. */
+static void unescape(char *s) {
+    char *w = s;
+    for (; *s; s++) {
+        if (*s == '%' && g_ascii_isxdigit(s[1]) && g_ascii_isxdigit(s[2])) {
+            *w++ = g_ascii_xdigit_value(s[1]) << 4 | g_ascii_xdigit_value(s[2]);
+            s += 2;
+        } else {
+            *w++ = *s;
+        }
+    }
+    *w = '\0';
+}
+
+/* Connects to one "unix:" address, modifying it.  Returns an fd or -1. */
+static int connect_unix(char *addr) {
+    struct sockaddr_un sa;
+    char *kv, *save = NULL;
+    int abstract = 0;
+    char *path = NULL;
+
+    for (kv = strtok_r(addr + 5, ",", &save); kv != NULL;
+            kv = strtok_r(NULL, ",", &save)) {
+        if (!strncmp(kv, "path=", 5)) {
+            path = kv + 5;
+        } else if (!strncmp(kv, "abstract=", 9)) {
+            path = kv + 9;
+            abstract = 1;
+        }
+    }
+    if (path == NULL)
+        return -1;
+    unescape(path);
+
+    size_t len = strlen(path);
+    if (len + abstract >= sizeof(sa.sun_path))
+        return -1;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    memcpy(sa.sun_path + abstract, path, len);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (connect(fd, (struct sockaddr *) &sa,
+                offsetof(struct sockaddr_un, sun_path) + abstract + len) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Reads the server's reply to AUTH.  It sends nothing more until we send
+ * BEGIN, so this can read in bulk without taking any of what follows.
+ */
+static int read_line(int fd, char *line, size_t cap) {
+    size_t len = 0;
+    while (len + 1 < cap) {
+        ssize_t n = read(fd, line + len, cap - 1 - len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        len += n;
+        if (len >= 2 && line[len - 2] == '\r' && line[len - 1] == '\n') {
+            line[len - 2] = '\0';
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int authenticate(int fd) {
+    char uid[16], line[256];
+    size_t i, len;
+
+    snprintf(uid, sizeof(uid), "%lu", (unsigned long) getuid());
+    len = snprintf(line, sizeof(line), "%cAUTH EXTERNAL ", '\0');
+    for (i = 0; uid[i]; i++)
+        len += snprintf(line + len, sizeof(line) - len, "%02x",
+                (unsigned char) uid[i]);
+    len += snprintf(line + len, sizeof(line) - len, "\r\n");
+
+    if (write_all(fd, line, len) || read_line(fd, line, sizeof(line)))
+        return -1;
+    return strncmp(line, "OK ", 3) ? -1 : 0;
+}
+
+extern wire *wire_open(void) {
+    const char *env = getenv("DBUS_SESSION_BUS_ADDRESS");
+    char *addrs, *addr, *save = NULL;
+    int fd = -1;
+
+    if (env == NULL)
+        return NULL;
+
+    addrs = strdup(env);
+    for (addr = strtok_r(addrs, ";", &save); addr != NULL && fd == -1;
+            addr = strtok_r(NULL, ";", &save)) {
+        if (!strncmp(addr, "unix:", 5))
+            fd = connect_unix(addr);
+    }
+    free(addrs);
+    if (fd == -1)
+        return NULL;
+
+    struct timeval tv = { .tv_sec = WIRE_TIMEOUT };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if (authenticate(fd)) {
+        close(fd);
+        return NULL;
+    }
+
+    wire *w = malloc(sizeof(wire));
+    w->fd = fd;
+    w->serial = 0;
+    w->out = new_buffer(BUF_LEN);
+    w->head = new_buffer(BUF_LEN);
+    w->body = new_buffer(BUF_LEN);
+
+    // No reply is needed to BEGIN, and Hello's can wait, so both go out
+    // with the first call.
+    put_str(w->out, "BEGIN\r\n");
+    w->hello = ++w->serial;
+    put_message(w, w->hello, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+            "org.freedesktop.DBus", "Hello", NULL);
+    return w;
+}
+
+extern void wire_close(wire *w) {
+    if (w == NULL)
+        return;
+    close(w->fd);
+    free_buffer(w->out);
+    free_buffer(w->head);
+    free_buffer(w->body);
+    free(w);
+}
+
+/*
+ * A message read off the wire.  'fields' holds the header fields we care
+ * about, indexed by field code.
+ */
+typedef struct {
+    unsigned char *data;
+    size_t body;        /* offset of the body */
+    uint32_t body_len;
+    char type;
+    int swap;
+    GVariant *fields[FIELD_SIGNATURE + 1];
+} message;
+
+static void free_message(message *m) {
+    size_t i;
+    for (i = 0; i <= FIELD_SIGNATURE; i++)
+        if (m->fields[i] != NULL)
+            g_variant_unref(m->fields[i]);
+    free(m->data);
+}
+
+static int read_message(wire *w, message *m) {
+    unsigned char head[16];
+    uint32_t fields_len;
+
+    memset(m, 0, sizeof(*m));
+    if (read_all(w->fd, head, sizeof(head)))
+        return -1;
+    if (head[0] != 'l' && head[0] != 'B')
+        goto bad;
+
+    m->type = head[1];
+    m->swap = (head[0] != (G_BYTE_ORDER == G_LITTLE_ENDIAN ? 'l' : 'B'));
+    reader r = { head, sizeof(head), 4, m->swap, 0 };
+    get_fixed(&r, 4, &m->body_len);
+    r.pos = 12;
+    get_fixed(&r, 4, &fields_len);
+    if (fields_len > WIRE_MAX_MSG || m->body_len > WIRE_MAX_MSG)
+        goto bad;
+
+    m->body = (16 + fields_len + 7) / 8 * 8;
+    size_t total = m->body + m->body_len;
+    m->data = malloc(total);
+    memcpy(m->data, head, sizeof(head));
+    if (read_all(w->fd, m->data + sizeof(head), total - sizeof(head)))
+        return -1;
+
+    r.data = m->data;
+    r.len = m->body;
+    r.pos = 12;
+    const char *sig = "a(yv)";
+    GVariant *fields = get_value(&r, &sig);
+    if (fields == NULL)
+        goto bad;
+    g_variant_ref_sink(fields);
+
+    GVariantIter iter;
+    guchar code;
+    GVariant *value;
+    g_variant_iter_init(&iter, fields);
+    while (g_variant_iter_next(&iter, "(yv)", &code, &value)) {
+        if (code <= FIELD_SIGNATURE && m->fields[code] == NULL)
+            m->fields[code] = value;
+        else
+            g_variant_unref(value);
+    }
+    g_variant_unref(fields);
+    return 0;
+
+bad:
+    errno = EPROTO;
+    return -1;
+}
+
+/* Returns the body of a message as a tuple, or NULL if it is malformed. */
+static GVariant *message_body(message *m) {
+    GVariant *sv = m->fields[FIELD_SIGNATURE];
+    const char *s = "";
+    if (sv != NULL && g_variant_is_of_type(sv, G_VARIANT_TYPE_SIGNATURE))
+        s = g_variant_get_string(sv, NULL);
+
+    char *sig = g_strdup_printf("(%s)", s);
+    const char *p = sig;
+    reader r = { m->data + m->body, m->body_len, 0, m->swap, 0 };
+    GVariant *body = get_value(&r, &p);
+    if (body != NULL && (*p != '\0' || r.pos != r.len)) {
+        g_variant_unref(g_variant_ref_sink(body));
+        body = NULL;
+    }
+    g_free(sig);
+    return body;
+}
+
+static uint32_t reply_serial(message *m) {
+    GVariant *v = m->fields[FIELD_REPLY_SERIAL];
+    if (v == NULL || !g_variant_is_of_type(v, G_VARIANT_TYPE_UINT32))
+        return 0;
+    return g_variant_get_uint32(v);
+}
+
+static void print_error(const char *name, message *m) {
+    GVariant *ev = m->fields[FIELD_ERROR_NAME];
+    GVariant *body = message_body(m);
+    const char *err = "unknown error", *msg = "";
+
+    if (ev != NULL && g_variant_is_of_type(ev, G_VARIANT_TYPE_STRING))
+        err = g_variant_get_string(ev, NULL);
+    if (body != NULL && g_variant_n_children(body) > 0) {
+        GVariant *mv = g_variant_get_child_value(body, 0);
+        if (g_variant_is_of_type(mv, G_VARIANT_TYPE_STRING))
+            msg = g_variant_get_string(mv, NULL);
+        g_variant_unref(mv);
+    }
+    fprintf(stderr, "DBus call error (%s): %s: %s\n", name, err, msg);
+    if (body != NULL)
+        g_variant_unref(g_variant_ref_sink(body));
+}
+
+extern GVariant *wire_call(wire *w, const char *name, GVariant *args) {
+    uint32_t serial = ++w->serial;
+    GVariant *result = NULL;
+    size_t len;
+    message m;
+
+    if (args != NULL)
+        g_variant_ref_sink(args);
+    int bad = put_message(w, serial, "org.freedesktop.Notifications",
+            "/org/freedesktop/Notifications",
+            "org.freedesktop.Notifications", name, args);
+    if (args != NULL)
+        g_variant_unref(args);
+    if (bad) {
+        fprintf(stderr, "DBus call error (%s): arguments cannot be sent "
+                "over D-Bus\n", name);
+        return NULL;
+    }
+
+    const char *p = buffer_view(w->out, &len);
+    int err = write_all(w->fd, p, len);
+    reset_buffer(w->out);
+    if (err) {
+        fprintf(stderr, "DBus call error (%s): %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    for (;;) {
+        if (read_message(w, &m)) {
+            free_message(&m);
+            fprintf(stderr, "DBus call error (%s): %s\n", name,
+                    strerror(errno));
+            return NULL;
+        }
+        if (m.type != MSG_METHOD_RETURN && m.type != MSG_ERROR) {
+            free_message(&m);
+            continue;
+        }
+
+        uint32_t rs = reply_serial(&m);
+        if (rs == w->hello) {
+            w->hello = 0;
+            if (m.type == MSG_ERROR) {
+                print_error("Hello", &m);
+                free_message(&m);
+                return NULL;
+            }
+        } else if (rs == serial) {
+            break;
+        }
+        free_message(&m);
+    }
+
+    if (m.type == MSG_ERROR) {
+        print_error(name, &m);
+    } else if ((result = message_body(&m)) == NULL) {
+        fprintf(stderr, "DBus call error (%s): malformed reply\n", name);
+    } else {
+        g_variant_ref_sink(result);
+    }
+    free_message(&m);
+    return result;
+}
@@ -0,0 +1,187 @@
+/* Copyright 2025 Jack Conger */
+
+/*
+ * This file is part of notcat.
+ *
+ * notcat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notcat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with notcat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The handler thread.  With --worker, events are handled on a thread of
+ * their own, so that notcat keeps answering D-Bus calls while a handler
+ * formats, writes or runs.  main.c hands events over through a ring with
+ * one producer (the bus thread) and one consumer (the handler thread),
+ * which needs no lock: each side writes only its own index.  The ring's
+ * indices count modulo twice its size, so that full and empty differ.
+ *
+ * Everything the handlers use -- run.c's jobs, coprocesses, output.c and
+ * the zygote -- then belongs to the handler thread, so their sources are
+ * added to its main context with handler_attach().  Without --worker, that
+ * is the default context and the bus thread does it all.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+#include "notcat.h"
+
+#define RING_SIZE 8     /* small, so waiting events stay in main.c's queue */
+
+int worker_opt = 0;
+
+static GMainContext *handler_ctx = NULL;    /* NULL for the default */
+
+static void *ring[RING_SIZE];
+static gint ring_head = 0;      /* written by the bus thread */
+static gint ring_tail = 0;      /* written by the handler thread */
+
+static gint handler_idle = 1;   /* the handler thread waits for a wakeup */
+static gint bus_waiting = 0;    /* the bus thread waits for room */
+static int wake_fds[2] = {-1, -1};
+
+static void (*handle_cb)(void *item) = NULL;
+static void (*room_cb)(void) = NULL;
+
+/*
+ * Adds a source for a handler to the handler thread's context.  Sources
+ * with other kinds of callback pass them cast to GSourceFunc, as GLib's
+ * own g_*_add() functions do.
+ */
+extern guint handler_attach(GSource *s, GSourceFunc fn, gpointer data) {
+    guint id;
+    g_source_set_callback(s, fn, data, NULL);
+    id = g_source_attach(s, handler_ctx);
+    g_source_unref(s);
+    return id;
+}
+
+extern void handler_source_remove(guint id) {
+    GSource *s = g_main_context_find_source_by_id(handler_ctx, id);
+    if (s)
+        g_source_destroy(s);
+}
+
+static gboolean room(gpointer data) {
+    room_cb();
+    return G_SOURCE_REMOVE;
+}
+
+/* Handles what is in the ring, as long as run.c can take it. */
+static void pump(void) {
+    gint tail = ring_tail;
+    int took = 0;
+
+    for (;;) {
+        if (tail == g_atomic_int_get(&ring_head)) {
+            // Check again once the bus thread can see we're waiting.
+            g_atomic_int_set(&handler_idle, 1);
+            if (tail == g_atomic_int_get(&ring_head))
+                break;
+            g_atomic_int_set(&handler_idle, 0);
+        }
+        if (!jobs_ready())
+            break;
+
+        void *item = ring[tail % RING_SIZE];
+        tail = (tail + 1) % (2 * RING_SIZE);
+        g_atomic_int_set(&ring_tail, tail);
+        took = 1;
+        handle_cb(item);
+    }
+
+    if (took && g_atomic_int_compare_and_exchange(&bus_waiting, 1, 0))
+        g_idle_add(room, NULL);
+}
+
+static gboolean wake(gint fd, GIOCondition cond, gpointer data) {
+    char b[64];
+    while (read(fd, b, sizeof(b)) > 0)
+        ;
+    pump();
+    return G_SOURCE_CONTINUE;
+}
+
+static gpointer run(gpointer data) {
+    GMainLoop *loop = g_main_loop_new(handler_ctx, FALSE);
+    g_main_context_push_thread_default(handler_ctx);
+    g_main_loop_run(loop);
+    return NULL;
+}
+
+/*
+ * Sets up the handler thread's context.  This must be done before anything
+ * calls handler_attach(), but the thread is only started by
+ * worker_start(), so that the zygote can still be forked first.
+ */
+extern void worker_init(void) {
+    if (!worker_opt)
+        return;
+
+    if (pipe(wake_fds) == -1) {
+        perror("notcat: pipe");
+        exit(1);
+    }
+    fcntl(wake_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(wake_fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(wake_fds[1], F_SETFD, FD_CLOEXEC);
+
+    handler_ctx = g_main_context_new();
+    handler_attach(g_unix_fd_source_new(wake_fds[0], G_IO_IN),
+                   (GSourceFunc) wake, NULL);
+}
+
+/*
+ * Starts the handler thread, which calls handle() with each item pushed.
+ * When the ring was full and has room again, room() is called on the bus
+ * thread.
+ */
+extern void worker_start(void (*handle)(void *item), void (*room)(void)) {
+    handle_cb = handle;
+    room_cb = room;
+    jobs_on_done(pump);
+    g_thread_unref(g_thread_new("handler", run, NULL));
+}
+
+/*
+ * Called on the bus thread.  Returns whether worker_push() has room; if
+ * not, the room callback is called once it does.
+ */
+extern int worker_ready(void) {
+    gint tail = g_atomic_int_get(&ring_tail);
+    if ((ring_head - tail + 2 * RING_SIZE) % (2 * RING_SIZE) != RING_SIZE)
+        return 1;
+
+    // Check again once the handler thread can see we're waiting.
+    g_atomic_int_set(&bus_waiting, 1);
+    return (g_atomic_int_get(&ring_tail) != tail);
+}
+
+extern void worker_push(void *item) {
+    ring[ring_head % RING_SIZE] = item;
+    g_atomic_int_set(&ring_head, (ring_head + 1) % (2 * RING_SIZE));
+
+    if (g_atomic_int_compare_and_exchange(&handler_idle, 1, 0)) {
+        while (write(wake_fds[1], "", 1) == -1 && errno == EINTR)
+            ;
+    }
+}
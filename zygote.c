@@ -0,0 +1,389 @@
+/* Copyright 2025 Jack Conger */
+
+/*
+ * This file is part of notcat.
+ *
+ * notcat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notcat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with notcat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The zygote: with --zygote, a helper process is forked at startup, before
+ * notcat has connected to D-Bus or grown its heap, and subcommands are
+ * spawned from it rather than from notcat itself.
+ *
+ * Each request is a zreq header followed by argc and then envc
+ * NUL-terminated strings (envc == 0 means the zygote's own environment).
+ * For each request, the zygote eventually answers with a zresp holding
+ * the wait status of the command, or the errno which kept it from being
+ * spawned.  Answers come in the order commands exit, matched up by tag.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+#include "notlib/notlib.h"
+#include "notcat.h"
+
+int zygote_opt = 0;
+
+typedef struct {
+    uint32_t tag;
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t len;   /* bytes of strings which follow */
+} zreq;
+
+typedef struct {
+    uint32_t tag;
+    int32_t status;
+    int32_t err;
+} zresp;
+
+/* A request still waiting for its answer, on either side. */
+typedef struct _zjob {
+    uint32_t tag;
+    zygote_cb cb;   /* in notcat */
+    void *data;
+    pid_t pid;      /* in the zygote */
+    struct _zjob *next;
+} zjob;
+
+static int zfd = -1;
+static guint zfd_watch = 0;
+static zjob *outstanding = NULL;
+
+static int read_all(int fd, void *p, size_t len) {
+    char *s = p;
+    while (len > 0) {
+        ssize_t r = read(fd, s, len);
+        if (r == 0)
+            return -1;
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        s += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int send_all(int fd, struct iovec *iov, size_t len) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    while (len > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = len;
+        ssize_t w = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (len > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            len--;
+        }
+        if (len > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The zygote itself.
+ */
+
+static int sigchld_pipe[2];
+
+static void on_sigchld(int sig) {
+    int saved = errno;
+    if (write(sigchld_pipe[1], "", 1) == -1) {
+        /* the pipe is full, so a wakeup is already pending */
+    }
+    errno = saved;
+}
+
+static void zygote_reply(int fd, uint32_t tag, int status, int err) {
+    zresp r = { tag, status, err };
+    struct iovec iov = { &r, sizeof(r) };
+    if (send_all(fd, &iov, 1) == -1)
+        _exit(0);
+}
+
+static void zygote_reap(int fd) {
+    char drain[64];
+    while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0)
+        ;
+
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        zjob *z, **zp;
+        for (zp = &outstanding; (z = *zp); zp = &z->next) {
+            if (z->pid == pid) {
+                *zp = z->next;
+                zygote_reply(fd, z->tag, status, 0);
+                free(z);
+                break;
+            }
+        }
+    }
+}
+
+static void zygote_request(int fd) {
+    zreq h;
+    if (read_all(fd, &h, sizeof(h)) == -1)
+        _exit(0);   /* notcat is gone */
+
+    char *strs = malloc(h.len + 1);
+    char **v = malloc(sizeof(char *) * (h.argc + h.envc + 2));
+    if (read_all(fd, strs, h.len) == -1)
+        _exit(0);
+
+    strs[h.len] = '\0';
+
+    char *s = strs;
+    uint32_t i, j = 0;
+    for (i = 0; i < h.argc; i++, s += strlen(s) + 1)
+        v[j++] = s;
+    v[j++] = NULL;
+    for (i = 0; i < h.envc; i++, s += strlen(s) + 1)
+        v[j++] = s;
+    v[j] = NULL;
+
+    pid_t pid;
+    int err = spawn_cmd(&pid, v, (h.envc ? v + h.argc + 1 : NULL));
+    if (err) {
+        zygote_reply(fd, h.tag, 0, err);
+    } else {
+        zjob *z = malloc(sizeof(zjob));
+        z->tag = h.tag;
+        z->pid = pid;
+        z->next = outstanding;
+        outstanding = z;
+    }
+
+    free(v);
+    free(strs);
+}
+
+static void zygote_main(int fd) {
+    struct sigaction sa;
+
+    if (pipe(sigchld_pipe) == -1) {
+        perror("pipe");
+        _exit(1);
+    }
+    fcntl(sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(sigchld_pipe[1], F_SETFL, O_NONBLOCK);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    for (;;) {
+        struct pollfd p[2] = {
+            { .fd = fd, .events = POLLIN },
+            { .fd = sigchld_pipe[0], .events = POLLIN }
+        };
+        if (poll(p, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            _exit(1);
+        }
+        if (p[1].revents)
+            zygote_reap(fd);
+        if (p[0].revents)
+            zygote_request(fd);
+    }
+}
+
+/*
+ * The notcat side.
+ */
+
+static gboolean zygote_orphans(gpointer data) {
+    // We can no longer tell when these finish, so consider them done.
+    while (outstanding) {
+        zjob *z = outstanding;
+        outstanding = z->next;
+        z->cb(-1, 0, z->data);
+        free(z);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Outstanding callbacks are run from the main loop, since we may be in the
+ * middle of starting jobs.
+ */
+static void zygote_lost(void) {
+    fprintf(stderr, "notcat: zygote exited; spawning commands directly\n");
+    if (zfd_watch) {
+        handler_source_remove(zfd_watch);
+        zfd_watch = 0;
+    }
+    close(zfd);
+    zfd = -1;
+    handler_attach(g_idle_source_new(), zygote_orphans, NULL);
+}
+
+static void zygote_dispatch(zresp *r) {
+    zjob *z, **zp;
+    for (zp = &outstanding; (z = *zp); zp = &z->next) {
+        if (z->tag == r->tag) {
+            *zp = z->next;
+            z->cb(r->status, r->err, z->data);
+            free(z);
+            return;
+        }
+    }
+}
+
+static gboolean zygote_readable(gint fd, GIOCondition cond, gpointer data) {
+    zresp r;
+    if (read_all(zfd, &r, sizeof(r)) == -1) {
+        zfd_watch = 0;
+        zygote_lost();
+        return G_SOURCE_REMOVE;
+    }
+    zygote_dispatch(&r);
+    return G_SOURCE_CONTINUE;
+}
+
+static void zygote_reaped(GPid pid, gint status, gpointer data) {
+    g_spawn_close_pid(pid);
+}
+
+extern void zygote_start(void) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        perror("socketpair");
+        return;
+    }
+
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        zygote_main(fds[1]);
+    }
+
+    close(fds[1]);
+    zfd = fds[0];
+    fcntl(zfd, F_SETFD, FD_CLOEXEC);
+    zfd_watch = handler_attach(
+            g_unix_fd_source_new(zfd, G_IO_IN | G_IO_HUP | G_IO_ERR),
+            (GSourceFunc) zygote_readable, NULL);
+    handler_attach(g_child_watch_source_new(pid),
+                   (GSourceFunc) zygote_reaped, NULL);
+}
+
+/*
+ * Asks the zygote to spawn argv; cb is called with the result.  Returns -1
+ * if there is no zygote, in which case the caller should spawn argv itself.
+ */
+extern int zygote_spawn(char **argv, char **envp, zygote_cb cb, void *data) {
+    static buffer *buf = NULL;
+    static uint32_t next_tag = 0;
+    zreq h = { next_tag++, 0, 0, 0 };
+
+    if (zfd == -1)
+        return -1;
+    if (!buf)
+        buf = new_buffer(BUF_LEN);
+    reset_buffer(buf);
+
+    for (; argv[h.argc]; h.argc++) {
+        put_str(buf, argv[h.argc]);
+        put_char(buf, '\0');
+    }
+    for (; envp && envp[h.envc]; h.envc++) {
+        put_str(buf, envp[h.envc]);
+        put_char(buf, '\0');
+    }
+
+    size_t len;
+    const char *strs = buffer_view(buf, &len);
+    h.len = len;
+
+    struct iovec iov[2] = {
+        { &h, sizeof(h) },
+        { (char *)strs, len }
+    };
+    if (send_all(zfd, iov, 2) == -1) {
+        zygote_lost();
+        return -1;
+    }
+
+    zjob *z = malloc(sizeof(zjob));
+    z->tag = h.tag;
+    z->cb = cb;
+    z->data = data;
+    z->next = outstanding;
+    outstanding = z;
+    return 0;
+}
+
+/* Blocks until the command spawned for 'data' has finished. */
+extern void zygote_wait(void *data) {
+    for (;;) {
+        zjob *z, **zp;
+        for (zp = &outstanding; (z = *zp); zp = &z->next)
+            if (z->data == data)
+                break;
+        if (z == NULL)
+            return;
+
+        zresp r;
+        if (zfd == -1 || read_all(zfd, &r, sizeof(r)) == -1) {
+            if (zfd != -1)
+                zygote_lost();
+            *zp = z->next;
+            free(z);
+            return;
+        }
+        zygote_dispatch(&r);
+    }
+}
+
+/* vim: set ft=c tabstop=4 softtabstop=4 shiftwidth=4 expandtab textwidth=0: */